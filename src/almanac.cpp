@@ -0,0 +1,183 @@
+#define LOG_MODULE LOG_MODULE_EPHEMERIS
+
+#include <atomic>
+#include <string.h>
+
+#include "almanac.h"
+
+// Orbit pages: subframe 5 pages 1-24, subframe 4 pages 2-5 and 7-10
+constexpr NAV_FIELD ALM_E = {NavBit(3, 9), 16, false, false, Pow2(-21)};
+constexpr NAV_FIELD ALM_T_OA = {NavBit(4, 1), 8, false, false, Pow2(12)};
+constexpr NAV_FIELD ALM_DELTA_I = {NavBit(4, 9), 16, true, true, Pow2(-19)};
+constexpr NAV_FIELD ALM_OMEGA_DOT = {NavBit(5, 1), 16, true, true, Pow2(-38)};
+constexpr NAV_FIELD ALM_HEALTH = {NavBit(5, 17), 8, false, false, 1};
+constexpr NAV_FIELD ALM_SQRT_A = {NavBit(6, 1), 24, false, false, Pow2(-11)};
+constexpr NAV_FIELD ALM_OMEGA_0 = {NavBit(7, 1), 24, true, true, Pow2(-23)};
+constexpr NAV_FIELD ALM_OMEGA = {NavBit(8, 1), 24, true, true, Pow2(-23)};
+constexpr NAV_FIELD ALM_M_0 = {NavBit(9, 1), 24, true, true, Pow2(-23)};
+constexpr NAV_FIELD ALM_A_F0_MSB = {NavBit(10, 1), 8, false, false, 1}; // a_f0 is split in two
+constexpr NAV_FIELD ALM_A_F1 = {NavBit(10, 9), 11, true, false, Pow2(-38)};
+constexpr NAV_FIELD ALM_A_F0_LSB = {NavBit(10, 20), 3, false, false, 1};
+
+#define ALM_I_REF 0.30 // semicircles, reference inclination of the almanac
+
+// Page 25 of subframe 5: t_oa, WN_a and health of SVs 1-24
+#define ALM_PAGE_25_SF5 51
+constexpr NAV_FIELD ALM_WN_A = {NavBit(3, 17), 8, false, false, 1};
+#define ALM_SF5_HEALTH NavBit(4, 1) // 6 bits per SV, SV 1 first
+
+// Page 25 of subframe 4: configuration of SVs 1-32 and health of SVs 25-32
+#define ALM_PAGE_25_SF4 63
+#define ALM_SF4_CONFIG NavBit(3, 9)  // 4 bits per SV, SV 1 first
+#define ALM_SF4_HEALTH NavBit(8, 19) // 6 bits per SV, SV 25 first
+
+struct ALMANAC_SLOT
+{
+    std::atomic<unsigned> seq; // odd while being written, 0 until first stored
+    ALMANAC alm;
+};
+
+static ALMANAC_SLOT Almanac[NUM_SATS + 1]; // indexed by PRN, 1-32
+static std::atomic<unsigned> WeekNum(0);
+
+static inline unsigned PackedBits(const uint32_t *nav, int bit, int len)
+{
+    NAV_FIELD f = {(uint8_t)bit, (uint8_t)len, false, false, 1};
+    return Bits(nav, f);
+}
+
+/**
+ * @brief copy of the almanac entry of an SV
+ * @return false if nothing has been received for it
+ */
+bool AlmanacGet(int sv, ALMANAC *out)
+{
+    if (sv < 1 || sv > NUM_SATS)
+        return false;
+    ALMANAC_SLOT &s = Almanac[sv];
+    for (;;)
+    {
+        unsigned seq = s.seq.load(std::memory_order_acquire);
+        if (seq == 0)
+            return false;
+        if (seq & 1)
+            continue;
+        memcpy(out, &s.alm, sizeof(ALMANAC));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load(std::memory_order_relaxed) == seq)
+            return true;
+    }
+}
+
+// Orbit, summary health and configuration of one entry come from different
+// pages, possibly decoded by several channels at once, so the whole
+// read-modify-write runs as the sequence lock's writer; a second writer
+// waits for the first, for the time of a memcpy. Every SV sends the same
+// almanac, so most pages change nothing: that is checked first, lock free.
+template <typename F>
+static void AlmanacUpdate(int sv, F update)
+{
+    ALMANAC old, a;
+    if (!AlmanacGet(sv, &old))
+        memset(&old, 0, sizeof(old));
+    a = old;
+    update(a);
+    if (0 == memcmp(&old, &a, sizeof(ALMANAC)))
+        return;
+
+    ALMANAC_SLOT &s = Almanac[sv];
+    unsigned seq = s.seq.load(std::memory_order_relaxed);
+    while ((seq & 1) || !s.seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire,
+                                                      std::memory_order_relaxed))
+        seq = s.seq.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    update(s.alm);
+    s.seq.store(seq + 2, std::memory_order_release);
+}
+
+static void OrbitPage(int sv, const uint32_t *nav)
+{
+    AlmanacUpdate(sv, [nav](ALMANAC &a) {
+        a.e = Field(nav, ALM_E);
+        a.t_oa = Field(nav, ALM_T_OA);
+        a.i_0 = ALM_I_REF * PI + Field(nav, ALM_DELTA_I);
+        a.OMEGA_dot = Field(nav, ALM_OMEGA_DOT);
+        a.health = Bits(nav, ALM_HEALTH);
+        a.sqrtA = Field(nav, ALM_SQRT_A);
+        a.OMEGA_0 = Field(nav, ALM_OMEGA_0);
+        a.omega = Field(nav, ALM_OMEGA);
+        a.M_0 = Field(nav, ALM_M_0);
+        a.a_f1 = Field(nav, ALM_A_F1);
+
+        // 11-bit two's complement, 8 MSBs then 3 LSBs
+        int32_t a_f0 = Bits(nav, ALM_A_F0_MSB) << 3 | Bits(nav, ALM_A_F0_LSB);
+        a.a_f0 = Pow2(-20) * ((a_f0 ^ 0x400) - 0x400);
+
+        a.have |= ALM_ORBIT;
+    });
+#ifdef LOG_DEBUG
+    Debug("Almanac PRN {}: t_oa {} health {:#04x} sqrtA {}", sv, Field(nav, ALM_T_OA), Bits(nav, ALM_HEALTH),
+          Field(nav, ALM_SQRT_A));
+#endif
+}
+
+// 6-bit health of SVs first .. first + num - 1, packed from bit 'bit'
+static void HealthPage(const uint32_t *nav, int bit, int first, int num)
+{
+    for (int i = 0; i < num; i++)
+    {
+        int sv = first + i;
+        if (sv > NUM_SATS)
+            break;
+        uint8_t summary = PackedBits(nav, bit + 6 * i, 6);
+        AlmanacUpdate(sv, [summary](ALMANAC &a) {
+            a.summary = summary;
+            a.have |= ALM_SUMMARY;
+        });
+    }
+}
+
+static void ConfigPage(const uint32_t *nav)
+{
+    for (int sv = 1; sv <= NUM_SATS; sv++)
+    {
+        uint8_t config = PackedBits(nav, ALM_SF4_CONFIG + 4 * (sv - 1), 4);
+        AlmanacUpdate(sv, [config](ALMANAC &a) {
+            a.config = config;
+            a.have |= ALM_CONFIG;
+        });
+    }
+}
+
+/**
+ * @brief decode a page of subframe 4 or 5 if it carries almanac or health data
+ * @param id subframe ID, 4 or 5
+ * @param nav the ten parity checked words of the subframe
+ */
+void AlmanacPage(int id, const uint32_t *nav)
+{
+    if (Bits(nav, NAV_DATA_ID) != NAV_DATA_ID_GPS)
+        return;
+
+    unsigned sv = Bits(nav, NAV_SV_ID); // 0 on dummy pages
+    if (sv >= 1 && sv <= NUM_SATS)
+        OrbitPage(sv, nav);
+    else if (id == 5 && sv == ALM_PAGE_25_SF5)
+    {
+        WeekNum.store(Bits(nav, ALM_WN_A), std::memory_order_relaxed);
+        HealthPage(nav, ALM_SF5_HEALTH, 1, 24);
+    }
+    else if (id == 4 && sv == ALM_PAGE_25_SF4)
+    {
+        ConfigPage(nav);
+        HealthPage(nav, ALM_SF4_HEALTH, 25, 8);
+    }
+}
+
+/**
+ * @brief almanac reference week WN_a, 8 LSBs, from subframe 5 page 25
+ */
+unsigned AlmanacWeek()
+{
+    return WeekNum.load(std::memory_order_relaxed);
+}
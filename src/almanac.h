@@ -0,0 +1,38 @@
+#ifndef _ALMANAC_H
+#define _ALMANAC_H 1
+
+#include "navbits.h"
+
+//////////////////////////////////////////////////////////////
+// Almanac
+//
+// Every SV broadcasts the almanac of the whole constellation in subframes 4
+// and 5, one SV per page, 12.5 minutes for all 25 pages. AlmanacPage()
+// decodes the orbit pages (subframe 5 pages 1-24, subframe 4 pages 2-5 and
+// 7-10) and the health pages (page 25 of both) into a table indexed by PRN,
+// coarse enough for visibility and Doppler prediction at warm start. All
+// channels write it, so entries are published under a sequence lock like
+// the ephemerides; read them with AlmanacGet().
+
+#define ALM_ORBIT 1   // orbit, clock and 8-bit health from the SV's page
+#define ALM_SUMMARY 2 // 6-bit health from page 25
+#define ALM_CONFIG 4  // anti-spoofing and SV configuration
+
+// Almanac fields are at most 24 bits; float keeps them to well below the
+// accuracy of the almanac itself.
+struct ALMANAC
+{
+    float e, t_oa, sqrtA;
+    float i_0, OMEGA_0, OMEGA_dot, omega, M_0; // radians, rad/s
+    float a_f0, a_f1;
+    uint8_t health;  // 8-bit SV health, from the SV's own page
+    uint8_t summary; // 6-bit SV health, from page 25 of subframe 4 or 5
+    uint8_t config;  // anti-spoofing flag and SV configuration, subframe 4 page 25
+    uint8_t have;    // ALM_ORBIT | ALM_SUMMARY | ALM_CONFIG: which of the above are set
+};
+
+void AlmanacPage(int id, const uint32_t *nav);
+bool AlmanacGet(int sv, ALMANAC *out); // 'sv' is the PRN, 1-32
+unsigned AlmanacWeek();
+
+#endif // _ALMANAC_H
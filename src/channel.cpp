@@ -1,43 +1,62 @@
+#define LOG_MODULE LOG_MODULE_CHANNEL
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <atomic>
 
 #include "devmem3.h"
 #include "ephemeris.h"
 #include "gps.h"
+#include "latency.h"
+#include "metrics.h"
+#include "stackless.h"
+#include "trace.h"
 
 const int RECV_MS = 1000;
 const int NAV_FRAME = 300;
 const int BIT_SYNC_MAX = 15;
 const int BIT_SYNC_HIGH = 12;
 const int BIT_SYNC_LOW = 5;
+const int POLLING = 10; // Buffer state polled 100 times per second, for all channels
+const int TIMEOUT = 20; // Bail after 20 buffers (20 seconds) on LOS
 
 const uint8_t preambleUpright[] = {1, 0, 0, 0, 1, 0, 1, 1};
 const uint8_t preambleInverse[] = {0, 1, 1, 1, 0, 1, 0, 0};
 
-static uint32_t BusyFlags;
+static std::atomic<uint32_t> BusyFlags; // channels with an SV assigned, bit per channel
 
 /**
- * @brief parity check for a word
- * @param p parity value of this word
- * @param word word to be checked
- * @param D29 29th bit of last word
- * @param D30 30th bit of last word
+ * @brief pack one 30-bit word of 'nav_buf' into an integer, first bit at bit 29
+ */
+static inline uint32_t PackWord(const uint8_t *bits)
+{
+    uint32_t word = 0;
+    for (int i = 0; i < 30; i++)
+        word += word + bits[i];
+    return word;
+}
+
+/**
+ * @brief parity check for a word, IS-GPS-200 Table 20-XIV
+ * @param word received word, D1 at bit 29
+ * @param last previous word, for D29* and D30*
+ * @param data receives d1..d24, D30* corrected, d1 at bit 23
  * @return 0 if parity good
  */
-static int parity(uint8_t *p, uint8_t *word, uint8_t D29, uint8_t D30)
+static int parity(uint32_t word, uint32_t last, uint32_t *data)
 {
-    uint8_t *d = word - 1;
-    for (int i = 1; i < 25; i++)
-        d[i] ^= D30;
-    p[0] = D29 ^ d[1] ^ d[2] ^ d[3] ^ d[5] ^ d[6] ^ d[10] ^ d[11] ^ d[12] ^ d[13] ^ d[14] ^ d[17] ^ d[18] ^ d[20] ^ d[23];
-    p[1] = D30 ^ d[2] ^ d[3] ^ d[4] ^ d[6] ^ d[7] ^ d[11] ^ d[12] ^ d[13] ^ d[14] ^ d[15] ^ d[18] ^ d[19] ^ d[21] ^ d[24];
-    p[2] = D29 ^ d[1] ^ d[3] ^ d[4] ^ d[5] ^ d[7] ^ d[8] ^ d[12] ^ d[13] ^ d[14] ^ d[15] ^ d[16] ^ d[19] ^ d[20] ^ d[22];
-    p[3] = D30 ^ d[2] ^ d[4] ^ d[5] ^ d[6] ^ d[8] ^ d[9] ^ d[13] ^ d[14] ^ d[15] ^ d[16] ^ d[17] ^ d[20] ^ d[21] ^ d[23];
-    p[4] = D30 ^ d[1] ^ d[3] ^ d[5] ^ d[6] ^ d[7] ^ d[9] ^ d[10] ^ d[14] ^ d[15] ^ d[16] ^ d[17] ^ d[18] ^ d[21] ^ d[22] ^ d[24];
-    p[5] = D29 ^ d[3] ^ d[5] ^ d[6] ^ d[8] ^ d[9] ^ d[10] ^ d[11] ^ d[13] ^ d[15] ^ d[19] ^ d[22] ^ d[23] ^ d[24];
-    return memcmp(d + 25, p, 6);
+    uint32_t D29 = last >> 1 & 1, D30 = last & 1;
+    uint32_t d = (word >> 6 ^ -D30) & 0xFFFFFF;
+    uint32_t p = (D29 ^ __builtin_parity(d & 0xEC7CD2)) << 5 |
+                 (D30 ^ __builtin_parity(d & 0x763E69)) << 4 |
+                 (D29 ^ __builtin_parity(d & 0xBB1F34)) << 3 |
+                 (D30 ^ __builtin_parity(d & 0x5D8F9A)) << 2 |
+                 (D30 ^ __builtin_parity(d & 0xAEC7CD)) << 1 |
+                 (D29 ^ __builtin_parity(d & 0x2DEA27));
+    *data = d;
+    return p != (word & 0x3F);
 }
 
 /**
@@ -62,7 +81,9 @@ struct CHANNEL
     uint8_t ch; // channel id
     uint8_t sv; // PRN of the satellite
 
-    uint8_t data_fetch_ok; // data fetch flag (1 for good)
+    uint8_t data_fetch_ok;  // data fetch flag (1 for good)
+    uint32_t rx_state_last; // ping-pong half fetched last
+    uint64_t fetch_ns;      // time of the last accepted fetch
 
     uint8_t recv_buf[RECV_MS * 2];
     uint16_t buf_tail;   // recv_buf data tail
@@ -82,7 +103,12 @@ struct CHANNEL
     void BitSampling();
     uint16_t ParityCheck(uint8_t *buf, uint16_t *nbits);
     void FrameSync();
+    bool Process();
+#ifdef GPS_STACKLESS
+    TASKLET Service();
+#else
     void Service();
+#endif
 };
 
 /**
@@ -125,28 +151,37 @@ void CHANNEL::Reset()
  */
 void CHANNEL::DataFetch()
 {
-    static uint32_t rx_state_last;
+    LAT_SCOPE lat(ch, LAT_FETCH);
     uint32_t rx_state;
     MemRead(0x50004400, &rx_state);
 
-#ifdef LOG_DEBUG
-    Debug("DataFetch rx_state: {}, rx_state_last: {}", rx_state, rx_state_last);
+#ifdef LOG_TRACE
+    Trace("DataFetch rx_state: {}, rx_state_last: {}", rx_state, rx_state_last);
 #endif
 
     if (rx_state_last == rx_state)
     {
-#ifdef LOG_DEBUG
-        Debug("DataFetch data not accepted", 0);
+#ifdef LOG_TRACE
+        Trace("DataFetch data not accepted", 0);
 #endif
         data_fetch_ok = 0;
+        TraceEvent(ch, TRACE_FETCH, rx_state, 0, buf_tail);
         return;
     }
-#ifdef LOG_DEBUG
-    Debug("DataFetch data accepted", 0);
+#ifdef LOG_TRACE
+    Trace("DataFetch data accepted", 0);
 #endif
     data_fetch_ok = 1;
     rx_state_last = rx_state;
 
+    // Each half of the ping-pong buffer is refilled every RECV_MS ms; if
+    // more than one and a half periods passed, a buffer was lost.
+    uint64_t now = Nanoseconds();
+    MetricAdd(ChanMetrics[ch].fetched);
+    if (fetch_ns && now - fetch_ns > (uint64_t)RECV_MS * 1500000)
+        MetricAdd(ChanMetrics[ch].overruns);
+    fetch_ns = now;
+
     uint32_t recv[RECV_MS];
     switch (rx_state)
     {
@@ -167,9 +202,10 @@ void CHANNEL::DataFetch()
         else
             recv_buf[buf_tail++] = 1;
     }
-#ifdef LOG_DEBUG
-    Debug("DataFetch buf_tail: {}", buf_tail);
-    Debug("DataFetch updated recv_buf: {}", array2str(recv_buf, buf_tail));
+    TraceEvent(ch, TRACE_FETCH, rx_state, 1, buf_tail);
+#ifdef LOG_TRACE
+    Trace("DataFetch buf_tail: {}", buf_tail);
+    Trace("DataFetch updated recv_buf: {}", BitsRle(recv_buf, buf_tail));
 #endif
 }
 
@@ -182,6 +218,8 @@ void CHANNEL::BitSync()
     // Return if bit alright synced.
     if (bit_sync_ok == 1)
         return;
+    LAT_SCOPE lat(ch, LAT_BIT_SYNC);
+    MetricAdd(ChanMetrics[ch].bit_sync_attempts);
 
     uint8_t ip;
     uint8_t ip_last;
@@ -222,8 +260,8 @@ void CHANNEL::BitSync()
         }
     }
 
-#ifdef LOG_DEBUG
-    Debug("BitSync edge_total:{}, max_edge_num:{}, sec_edge_num:{}", edge_total, max_edge_num, sec_edge_num);
+#ifdef LOG_TRACE
+    Trace("BitSync edge_total:{}, max_edge_num:{}, sec_edge_num:{}", edge_total, max_edge_num, sec_edge_num);
 #endif
 
     // Judge whether bit synced.
@@ -231,11 +269,16 @@ void CHANNEL::BitSync()
     if (edge_total > BIT_SYNC_MAX && max_edge_num > BIT_SYNC_HIGH && sec_edge_num < BIT_SYNC_LOW)
     {
         bit_sync_ok = 1;
+        MetricAdd(ChanMetrics[ch].bit_syncs);
         bit_head += max_edge_idx;
         bit_tail += max_edge_idx;
+        TraceEvent(ch, TRACE_BIT_SYNC, edge_total, max_edge_num, sec_edge_num, bit_head);
     }
     else
+    {
+        TraceEvent(ch, TRACE_BIT_SYNC, edge_total, max_edge_num, sec_edge_num, (uint32_t)-1);
         RecvReset();
+    }
 }
 
 /**
@@ -244,8 +287,11 @@ void CHANNEL::BitSync()
  */
 void CHANNEL::BitSampling()
 {
+    LAT_SCOPE lat(ch, LAT_BIT_SAMPLE);
     uint8_t cnt = 0;
     uint8_t bit_sum = 0;
+    uint16_t nav_head = nav_tail;
+    PERF_SCOPE perf(PERF_BIT_SAMPLE, bit_tail - bit_head); // per 1 ms sample
 
     uint16_t i;
     for (i = bit_head; i < bit_tail; i++)
@@ -268,6 +314,7 @@ void CHANNEL::BitSampling()
     else
         buf_tail -= RECV_MS;
     memcpy(recv_buf, recv_buf + RECV_MS, buf_tail);
+    TraceEvent(ch, TRACE_BIT_SAMPLE, nav_tail - nav_head, nav_tail);
     // clear frame synced flag
     frame_sync_ok = 1;
 }
@@ -280,26 +327,58 @@ void CHANNEL::BitSampling()
  */
 uint16_t CHANNEL::ParityCheck(uint8_t *buf, uint16_t *nbits)
 {
-    uint8_t p[6];
+    uint32_t nav[NAV_WORDS], last;
 
     // Upright or inverted preamble, setting of parity bits resolves phase ambiguity.
-    if (0 == memcmp(buf, preambleUpright, 8))
-        p[4] = p[5] = 0;
-    else if (0 == memcmp(buf, preambleInverse, 8))
-        p[4] = p[5] = 1;
-    else
-        return *nbits = 1; // return if no preamble found
+    {
+        PERF_SCOPE perf(PERF_PREAMBLE);
+        if (0 == memcmp(buf, preambleUpright, 8))
+            last = 0;
+        else if (0 == memcmp(buf, preambleInverse, 8))
+            last = 3;
+        else
+            return *nbits = 1; // return if no preamble found
+    }
 
-    // Parity check up to ten 30-bit words.
-    uint16_t i;
-    for (i = 0; i < 300; i += 30)
+    // Parity check up to ten 30-bit words, keeping their corrected data bits.
     {
-        if (0 != parity(p, buf + i, p[4], p[5]))
-            return *nbits = i + 30; // return if word parity check failed
+        PERF_SCOPE perf(PERF_PARITY, 0); // per word
+        for (int i = 0; i < NAV_WORDS; i++)
+        {
+            uint32_t word = PackWord(buf + 30 * i);
+            perf.ops++;
+            if (0 != parity(word, last, &nav[i]))
+            {
+                MetricAdd(ChanMetrics[ch].parity_failures);
+                return *nbits = 30 * i + 30; // return if word parity check failed
+            }
+            last = word;
+        }
     }
 
-    // Subframe found and parity check good, depack subframe.
-    Ephemeris[sv].Subframe(buf);
+    // Subframe found and parity check good, decode subframe.
+    int id = nav[1] >> 2 & 7; // subframe ID, HOW bits 20-22
+    {
+        LAT_SCOPE lat(ch, LAT_SUBFRAME);
+        if (Ephemeris[sv].Subframe(nav))
+        {
+            if (EphemerisPublish(sv))
+                SvMetrics[sv].ephem_ns.store(Nanoseconds(), std::memory_order_relaxed);
+        }
+        else if (id >= 1 && id <= 3)
+            MetricAdd(SvMetrics[sv].repeats);
+    }
+    if (Ephemeris[sv].Valid() && fetch_ns)
+    { // TOW count is the time at the start of the next subframe, i.e. at the
+      // end of this one. The newest sample came in with the last fetch; after
+      // the subframe's last bit there are (nav_tail - 300) nav bits of 20 ms
+      // and (buf_tail - bit_head) samples of 1 ms not yet sampled into bits.
+        int64_t pending_ms = (int64_t)(nav_tail - 300) * 20 + (int64_t)buf_tail - bit_head;
+        GpsTimeSet(Ephemeris[sv].Week(), Ephemeris[sv].tow * 6.0, fetch_ns - pending_ms * 1000000);
+    }
+    MetricAdd(ChanMetrics[ch].subframes);
+    MetricAdd(SvMetrics[sv].subframes);
+    TraceEvent(ch, TRACE_SUBFRAME, sv, id, Ephemeris[sv].tow);
     *nbits = 300;
     return 0;
 }
@@ -310,61 +389,110 @@ uint16_t CHANNEL::ParityCheck(uint8_t *buf, uint16_t *nbits)
  */
 void CHANNEL::FrameSync()
 {
+    LAT_SCOPE lat(ch, LAT_FRAME_SYNC);
     while (nav_tail >= 300) // enough for a subframe
     {
         uint16_t nbits;
         uint16_t frame_sync_ok = ParityCheck(nav_buf, &nbits);
-#ifdef LOG_DEBUG
-        Debug("Frame sync nbits:{}.", nbits);
+#ifdef LOG_TRACE
+        Trace("Frame sync nbits:{}.", nbits);
 #endif
         nav_tail -= nbits;
         memcpy(nav_buf, nav_buf + nbits, nav_tail); // shift 'nav_buf'
+        TraceEvent(ch, TRACE_FRAME_SYNC, nbits, nav_tail);
     }
 }
 
-void CHANNEL::Service()
+/**
+ * @brief run a freshly fetched buffer through bit sync, sampling and frame sync
+ * @return true if a subframe was decoded
+ */
+bool CHANNEL::Process()
 {
+    // The other half becomes ready one buffer period after the fetch and is
+    // overwritten one period later; it has to be fetched before then.
+    TaskDeadline(fetch_ns + (uint64_t)RECV_MS * 2000000);
+    BitSync();
+    if (bit_sync_ok != 1)
+        return false;
+
 #ifdef LOG_INFO
-    Info("Enter channel {}: PRN {}.", ch, sv);
+    Info("Bit synced for channel {}: PRN {}. Bit offset {}ms.", ch, sv, bit_head);
 #endif
+    BitSampling();
+#ifdef LOG_DEBUG
+    Debug("Updated nav_buf: {}.", BitsHex(nav_buf, nav_tail));
+#endif
+    FrameSync();
+    if (frame_sync_ok != 0)
+        return false;
 
-    const int POLLING = 250; // Poll 4 times per second
-    const int TIMEOUT = 80;  // Bail after 20 seconds on LOS
-    for (int watchdog = 0; watchdog < TIMEOUT; watchdog++)
-    {
-        TimerWait(POLLING);
-        DataFetch();
-        if (data_fetch_ok == 1)
-        {
-            BitSync();
-            if (bit_sync_ok == 1)
-            {
 #ifdef LOG_INFO
-                Info("Bit synced for channel {}: PRN {}. Bit offset {}ms.", ch, sv, bit_head);
+    Info("Frame synced for channel {}: PRN {}.", ch, sv);
 #endif
-                BitSampling();
 #ifdef LOG_DEBUG
-                Debug("Updated nav_buf: {}.", array2str(nav_buf, nav_tail));
+    Ephemeris[sv].PrintAll();
 #endif
-                FrameSync();
-                if (frame_sync_ok == 0)
-                {
-                    watchdog = 0;
+    return true;
+}
+
+#ifdef GPS_STACKLESS
+// Wait for the data-ready event, then fetch; resumes with true if a new buffer arrived.
+struct WAITBUFFER : WAITEVENT
+{
+    CHANNEL &chan;
+
+    WAITBUFFER(CHANNEL &c) : WAITEVENT(EVENT_CHAN_DATA(c.ch)), chan(c) {}
+    bool await_resume()
+    {
+        chan.DataFetch();
+        return chan.data_fetch_ok == 1;
+    }
+};
+
+static WAITBUFFER WaitBuffer(CHANNEL &c)
+{
+    return WAITBUFFER(c);
+}
+
+TASKLET CHANNEL::Service()
+{
 #ifdef LOG_INFO
-                    Info("Frame synced for channel {}: PRN {}.", ch, sv);
+    Info("Enter channel {}: PRN {}.", ch, sv);
 #endif
-#ifdef LOG_DEBUG
-                    Ephemeris[sv].PrintAll();
+
+    for (int watchdog = 0; watchdog < TIMEOUT; watchdog++)
+    {
+        if (co_await WaitBuffer(*this) && Process())
+            watchdog = 0;
+    }
+
+    TraceEvent(ch, TRACE_LOST, sv);
+#ifdef LOG_INFO
+    Info("Leave channel {}: PRN {}.", ch, sv);
 #endif
-                }
-            }
-        }
+}
+#else
+void CHANNEL::Service()
+{
+#ifdef LOG_INFO
+    Info("Enter channel {}: PRN {}.", ch, sv);
+#endif
+
+    for (int watchdog = 0; watchdog < TIMEOUT; watchdog++)
+    {
+        EventWait(EVENT_CHAN_DATA(ch));
+        DataFetch();
+        if (data_fetch_ok == 1 && Process())
+            watchdog = 0;
     }
 
+    TraceEvent(ch, TRACE_LOST, sv);
 #ifdef LOG_INFO
     Info("Leave channel {}: PRN {}.", ch, sv);
 #endif
 }
+#endif
 
 static CHANNEL Chans[NUM_CHANS];
 
@@ -378,23 +506,109 @@ void ChanReset()
     }
 }
 
+#ifdef GPS_STACKLESS
+#define FRAME_SIZE 256               // coroutine frame budget per channel (Service needs ~112 bytes, logged)
+#define SPAWN_BACKOFF 60000000000ull // ns before a tasklet that did not fit is tried again
+
+// ARENA::Alloc hands out frames at max_align_t boundaries from here
+static_assert(FRAME_SIZE % alignof(max_align_t) == 0, "FRAME_SIZE must keep every row aligned");
+alignas(max_align_t) static char FrameMem[NUM_CHANS][FRAME_SIZE];
+static ARENA Arenas[NUM_CHANS];
+static TASKLET Tasklets[NUM_CHANS];
+static uint64_t SpawnAfter[NUM_CHANS];
+
+void ChanTask()
+{ // every channel is a tasklet hosted on this one task
+    TaskName(TaskSelf(), "channels");
+    TaskPriority(TaskSelf(), PRIO_CHANNEL);
+    for (int ch = 0; ch < NUM_CHANS; ch++)
+    {
+        Chans[ch].ch = ch;
+        Arenas[ch].Init(FrameMem[ch], FRAME_SIZE);
+    }
+    size_t peak = 0;
+    for (;;)
+    {
+        unsigned idle = 0;
+        for (int ch = 0; ch < NUM_CHANS; ch++)
+        {
+            if (Tasklets[ch].Done())
+                Tasklets[ch] = TASKLET(); // returned after loss of signal
+            if ((BusyFlags & (1 << ch)) && !Tasklets[ch] && Nanoseconds() >= SpawnAfter[ch])
+            {
+                Tasklets[ch] = TaskletSpawn(Arenas[ch], [ch] { return Chans[ch].Service(); });
+                if (!Tasklets[ch])
+                    SpawnAfter[ch] = Nanoseconds() + SPAWN_BACKOFF; // frame did not fit, already logged
+                else if (Arenas[ch].used > peak)
+                {
+                    peak = Arenas[ch].used;
+#ifdef LOG_INFO
+                    Info("Channel tasklet frame uses {} of {} bytes", peak, FRAME_SIZE);
+#endif
+                }
+            }
+            if (!Tasklets[ch])
+                idle |= EVENT_CHAN_DATA(ch); // raised by ChanStart, or by the next buffer
+        }
+        StacklessRun(idle);
+    }
+}
+#else
 void ChanTask()
 { // one thread per channel
-    static int inst;
+    static std::atomic<int> inst;
     int ch = inst++; // which channel am I?
     Chans[ch].ch = ch;
+    char name[16];
+    snprintf(name, sizeof(name), "chan%d", ch);
+    TaskName(TaskSelf(), name);
+    TaskPriority(TaskSelf(), PRIO_CHANNEL);
+    TaskAffinity(TaskSelf(), ch); // keep this channel's buffers hot on one core
     for (;;)
     {
         if (BusyFlags & (1 << ch))
             Chans[ch].Service(); // returns after loss of signal
-        // NextTask();
+        else
+            EventWait(EVENT_CHAN_DATA(ch)); // raised by ChanStart
     }
 }
+#endif
 
-void ChanStart(uint8_t ch, uint8_t sv)
+/**
+ * @brief watch the ping-pong buffer state for all channels and raise the
+ * data-ready event of each busy one when a half has been refilled
+ */
+void ChanDataTask()
+{
+    TaskName(TaskSelf(), "chandata");
+    TaskPriority(TaskSelf(), PRIO_CHANNEL);
+    uint32_t rx_state_last = 0;
+    for (;;)
+    {
+        TimerWait(POLLING);
+        uint32_t rx_state;
+        MemRead(0x50004400, &rx_state);
+        if (rx_state == rx_state_last)
+            continue;
+        rx_state_last = rx_state;
+        EventRaise(BusyFlags); // EVENT_CHAN_DATA(ch) is bit 'ch', as in BusyFlags
+    }
+}
+
+/**
+ * @brief assign 'sv' to channel 'ch'
+ * @return false if another channel already tracks 'sv'; Ephemeris[sv] is
+ * assembled by the one channel tracking it, on whichever worker it runs
+ */
+bool ChanStart(uint8_t ch, uint8_t sv)
 {
+    for (int i = 0; i < NUM_CHANS; i++)
+        if (i != ch && (BusyFlags & (1 << i)) && Chans[i].sv == sv)
+            return false;
     Chans[ch].sv = sv;
     BusyFlags |= (1 << ch);
+    EventRaise(EVENT_CHAN_DATA(ch));
+    return true;
 }
 
 #ifdef CHANNEL_TEST
@@ -402,7 +616,7 @@ void DataInject(uint8_t ch, uint8_t *input)
 {
     memcpy(Chans[ch].recv_buf + Chans[ch].buf_tail, input, RECV_MS);
 
-    Debug("{}", array2str(input, RECV_MS));
+    Debug("{}", BitsRle(input, RECV_MS));
 
     Chans[ch].buf_tail += RECV_MS;
 }
@@ -423,7 +637,7 @@ void TestBitSampling(uint8_t ch)
         Chans[ch].BitSampling();
         Chans[ch].FrameSync();
 
-        Debug("{}", array2str(Chans[ch].nav_buf, Chans[ch].nav_tail));
+        Debug("{}", BitsHex(Chans[ch].nav_buf, Chans[ch].nav_tail));
     }
 }
 #endif
@@ -18,78 +18,1103 @@
 // http://www.aholme.co.uk/GPS/Main.htm
 //////////////////////////////////////////////////////////////////////////
 
+#define LOG_MODULE LOG_MODULE_SCHED
+
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "gps.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Time base
+//
+// All scheduling runs off a 64-bit monotonic nanosecond count, which neither
+// wraps nor steps when NTP or the PPS discipline adjusts the wall clock.
+// Build with -DCLOCK_SOURCE=CLOCK_MONOTONIC_RAW to ignore NTP slewing as well,
+// or with -DCLOCK_TSC on x86-64 to read the invariant TSC instead of making a
+// vDSO call.
+
+#ifndef CLOCK_SOURCE
+#define CLOCK_SOURCE CLOCK_MONOTONIC
+#endif
+
+static uint64_t ClockRead(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_SOURCE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(CLOCK_TSC) && defined(__x86_64__)
+#include <x86intrin.h>
+
+static uint64_t TscBase, NsBase;
+static uint64_t TscMult; // ns per tick in 32.32 fixed point
+static std::once_flag TscOnce;
+
+static void TscCalibrate(void)
+{
+    uint64_t ns0 = ClockRead(), tsc0 = __rdtsc();
+    struct timespec ts = {0, 10000000};
+    nanosleep(&ts, NULL);
+    uint64_t ns1 = ClockRead(), tsc1 = __rdtsc();
+    TscMult = (uint64_t)(((unsigned __int128)(ns1 - ns0) << 32) / (tsc1 - tsc0));
+    TscBase = tsc1;
+    NsBase = ns1;
+}
+
+uint64_t Nanoseconds(void)
+{
+    std::call_once(TscOnce, TscCalibrate);
+    return NsBase + (uint64_t)(((unsigned __int128)(__rdtsc() - TscBase) * TscMult) >> 32);
+}
+#else
+uint64_t Nanoseconds(void)
+{
+    return ClockRead();
+}
+#endif
+
+uint64_t Microseconds(void)
+{
+    return Nanoseconds() / 1000;
+}
+
+// GPS time = monotonic time + offset, established once a fix exists.
+static std::atomic<int64_t> GpsOffset(0);
+
+/**
+ * @brief anchor GPS time to the monotonic clock
+ * @param week GPS week number
+ * @param tow time of week (s) valid at monotonic instant 'ns'
+ * @param ns monotonic timestamp from Nanoseconds()
+ */
+void GpsTimeSet(unsigned week, double tow, uint64_t ns)
+{
+    int64_t gps_ns = (int64_t)week * 604800 * 1000000000 + (int64_t)(tow * 1e9);
+    GpsOffset.store(gps_ns - (int64_t)ns, std::memory_order_relaxed);
+}
+
+/**
+ * @brief convert a monotonic timestamp to GPS time
+ * @return false if GPS time has not been established
+ */
+bool GpsTimeGet(uint64_t ns, unsigned *week, double *tow)
+{
+    int64_t offset = GpsOffset.load(std::memory_order_relaxed);
+    if (offset == 0)
+        return false;
+    int64_t gps_ns = (int64_t)ns + offset;
+    int64_t week_ns = (int64_t)604800 * 1000000000;
+    *week = gps_ns / week_ns;
+    *tow = (gps_ns % week_ns) * 1e-9;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Locking
+//
+// Run queues, the task table, the stack pool and the event wait queues are
+// shared between workers. Critical sections are a handful of pointer moves.
+
+struct SPINLOCK
+{
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+    void lock()
+    {
+        for (int spins = 0; flag.test_and_set(std::memory_order_acquire); spins++)
+            if (spins > 100)
+                sched_yield();
+    }
+    void unlock() { flag.clear(std::memory_order_release); }
+};
+
+static int Futex(std::atomic<unsigned> *addr, int op, unsigned val, const struct timespec *ts)
+{
+    return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stack pool
+//
+// Task stacks are mmap'd on demand with a PROT_NONE guard page below them, so
+// an overflow faults instead of corrupting a neighbour. Pages are only
+// committed when touched; on task exit they are handed back with
+// MADV_DONTNEED and the region is kept on a per-size free list for reuse.
+// That also keeps mincore() an accurate high-water-mark probe.
+
+struct STACK
+{
+    STACK *next; // free list
+    char *base;  // lowest usable byte, just above the guard page
+    size_t size; // usable bytes, a power-of-two number of pages
+};
+
+static STACK *StackPool[32];
+static SPINLOCK StackLock;
+
+static size_t PageSize()
+{
+    static size_t page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+static int StackClass(size_t size, size_t *rounded)
+{
+    int cls = 0;
+    size_t bytes = PageSize();
+    while (bytes < size)
+        bytes <<= 1, cls++;
+    *rounded = bytes;
+    return cls;
+}
+
+static STACK *StackAlloc(size_t size)
+{
+    size_t bytes;
+    int cls = StackClass(size, &bytes);
+    StackLock.lock();
+    STACK *s = StackPool[cls];
+    if (s)
+        StackPool[cls] = s->next;
+    StackLock.unlock();
+    if (s)
+        return s;
 
-#define STACK_SIZE 8192
-#define MAX_TASKS 20
+    size_t guard = PageSize();
+    void *map = mmap(NULL, guard + bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    mprotect(map, guard, PROT_NONE);
 
-unsigned __pointer_chk_guard;
+    s = new STACK;
+    s->base = (char *)map + guard;
+    s->size = bytes;
+    return s;
+}
+
+static void StackFree(STACK *s)
+{
+    size_t bytes;
+    int cls = StackClass(s->size, &bytes);
+    madvise(s->base, s->size, MADV_DONTNEED);
+    StackLock.lock();
+    s->next = StackPool[cls];
+    StackPool[cls] = s;
+    StackLock.unlock();
+}
+
+/**
+ * @return bytes of stack touched, measured from the top down to the lowest
+ * resident page
+ */
+static size_t StackUsage(STACK *s)
+{
+    size_t page = PageSize(), pages = s->size / page;
+    unsigned char vec[64]; // residency of up to 64 pages per mincore call
+    for (size_t i = 0; i < pages; i += sizeof(vec))
+    {
+        size_t n = pages - i < sizeof(vec) ? pages - i : sizeof(vec);
+        if (mincore(s->base + i * page, n * page, vec))
+            return 0;
+        for (size_t j = 0; j < n; j++)
+            if (vec[j] & 1)
+                return s->size - (i + j) * page;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tasks and workers
+//
+// M:N runtime: tasks run on NumWorkers threads. Each worker has its own run
+// queue, timer wheel and a scheduler context (Go's "g0"): a task gives up the
+// CPU by jumping to its worker's scheduler, which files the task where it
+// belongs (run queue, wheel, event queue) only once its context is saved, so
+// another worker can never resume a half-suspended task. Idle workers steal
+// unpinned tasks from the others, then sleep on a futex.
+//
+// Worker 0 is the thread that calls main(); until SchedStart() is called it
+// is the only one.
+
+#define MAX_WORKERS 16
+#define TICK_NS 1000000
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define SCHED_STACK (64 * 1024)
+
+enum
+{
+    TASK_RUN,   // yielded, still runnable
+    TASK_SLEEP, // in TimerWait
+    TASK_WAIT,  // in EventWait
+    TASK_EXIT,
+};
 
 struct TASK
 {
-    int stk[STACK_SIZE];
-    union
+    jmp_buf jb;
+    int id;
+    void (*entry)();
+    STACK *stack;           // NULL for the main task, which runs on the process stack
+    bool fresh;             // not yet switched to
+    int state;              // why it last gave up the CPU
+    int prio = PRIO_NORMAL; // higher runs first
+    int affinity = -1;      // worker it is pinned to, -1 if free to migrate
+    uint64_t deadline;      // ns by which the task should next run, 0 if none
+    uint64_t wake_at;       // ns TimerWait asked to be woken at, 0 if none
+    uint64_t created;       // ns
+    char name[16];
+    TASK_STATS stats;
+    TASK *next;             // run queue or timer wheel slot
+    uint64_t expires;       // wakeup tick while parked on the wheel
+    unsigned waiting;       // event mask while parked in EventWait
+    struct WAITNODE *wait;  // one node per bit of 'waiting', on the waiter's stack
+};
+
+struct TASKLIST
+{
+    TASK *head, *tail;
+};
+
+struct WORKER
+{
+    int id;
+    TASK *current;                // running task, NULL while in the scheduler
+    uint64_t dispatched;          // ns 'current' was switched in
+    jmp_buf sched;                // scheduler context
+    bool booted;                  // scheduler context exists
+    ucontext_t boot;              // used to enter fresh tasks
+
+    SPINLOCK lock;                // guards the run queue
+    TASKLIST run[NUM_PRIOS];
+    unsigned mask;                // bit set for each non-empty priority level
+
+    TASKLIST wheel[WHEEL_LEVELS][WHEEL_SIZE]; // owner only
+    uint64_t tick;                // next tick to be processed
+
+    std::atomic<int> idle;        // sleeping on 'kick'
+    std::atomic<unsigned> kick;   // futex word
+
+    WORKER(int id, TASK *current)
+        : id(id), current(current), booted(false), mask(0), tick(0), idle(0), kick(0)
+    {
+        memset(run, 0, sizeof(run));
+        memset(wheel, 0, sizeof(wheel));
+        if (current) // main task, running since startup
+            current->created = dispatched = Nanoseconds();
+    }
+};
+
+static TASK MainTask;
+static std::vector<TASK *> Tasks(1, &MainTask);
+static SPINLOCK TaskLock;
+
+static WORKER Worker0(0, &MainTask);
+static WORKER *Workers[MAX_WORKERS] = {&Worker0};
+static std::atomic<int> NumWorkers(1);
+static __thread WORKER *volatile Self = &Worker0;
+
+static bool Edf; // order each level by deadline
+static std::atomic<unsigned> DeadlineMisses(0);
+static std::atomic<bool> DumpRequested(false);
+
+/**
+ * @return the worker running the caller. Not inlined, and reading a volatile,
+ * so the compiler cannot reuse a thread pointer from before a task switch:
+ * the task may resume on another worker.
+ */
+static __attribute__((noinline)) WORKER *Me()
+{
+    return Self;
+}
+
+static TASK *Current()
+{
+    return Me()->current;
+}
+
+static void ListPush(TASKLIST *l, TASK *t)
+{
+    t->next = NULL;
+    if (l->tail)
+        l->tail->next = t;
+    else
+        l->head = t;
+    l->tail = t;
+}
+
+static TASK *ListPop(TASKLIST *l)
+{
+    TASK *t = l->head;
+    if (t && !(l->head = t->next))
+        l->tail = NULL;
+    return t;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run queues
+
+/**
+ * @brief queue a task on worker 'w' at its priority; with EDF on, tasks with
+ * a deadline go ahead of later deadlines and of tasks without one
+ */
+static void RunPush(WORKER *w, TASK *t)
+{
+    w->lock.lock();
+    TASKLIST *l = w->run + t->prio;
+    w->mask |= 1 << t->prio;
+    if (!Edf || !t->deadline)
+        ListPush(l, t);
+    else
+    {
+        TASK **link = &l->head;
+        while (*link && (*link)->deadline && (*link)->deadline <= t->deadline)
+            link = &(*link)->next;
+        if (!(t->next = *link))
+            l->tail = t;
+        *link = t;
+    }
+    w->lock.unlock();
+
+    if (w != Me())
+    {
+        w->kick.fetch_add(1);
+        if (w->idle.load())
+            Futex(&w->kick, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+/**
+ * @brief make a task runnable: on its pinned worker if it has one, else here
+ */
+static void Wake(TASK *t)
+{
+    int n = NumWorkers.load(std::memory_order_relaxed);
+    RunPush(t->affinity < 0 ? Me() : Workers[t->affinity % n], t);
+}
+
+static TASK *RunPop(WORKER *w)
+{
+    w->lock.lock();
+    TASK *t = NULL;
+    if (w->mask)
+    {
+        int prio = 31 - __builtin_clz(w->mask);
+        t = ListPop(w->run + prio);
+        if (!w->run[prio].head)
+            w->mask &= ~(1 << prio);
+    }
+    w->lock.unlock();
+    return t;
+}
+
+/**
+ * @brief take the most urgent unpinned task from another worker
+ */
+static TASK *Steal(WORKER *w)
+{
+    int n = NumWorkers.load(std::memory_order_relaxed);
+    for (int i = 1; i < n; i++)
     {
-        jmp_buf jb;
-        unsigned u[1];
-        struct
+        WORKER *v = Workers[(w->id + i) % n];
+        v->lock.lock();
+        for (unsigned m = v->mask; m; m &= ~(1 << (31 - __builtin_clz(m))))
         {
-            void *v[6], *sl, *fp, *sp, (*pc)();
-        };
-    };
+            int prio = 31 - __builtin_clz(m);
+            TASKLIST *l = v->run + prio;
+            TASK *prev = NULL;
+            for (TASK *t = l->head; t; prev = t, t = t->next)
+            {
+                if (t->affinity >= 0)
+                    continue;
+                if (prev)
+                    prev->next = t->next;
+                else
+                    l->head = t->next;
+                if (l->tail == t)
+                    l->tail = prev;
+                if (!l->head)
+                    v->mask &= ~(1 << prio);
+                v->lock.unlock();
+                return t;
+            }
+        }
+        v->lock.unlock();
+    }
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timer wheel
+//
+// Tasks in TimerWait are parked off the run queue in a hierarchical wheel of
+// 1ms ticks: four levels of 64 slots cover ~4.6 hours. Insertion is O(1);
+// each tick touches one level-0 slot, plus one higher-level slot that is
+// cascaded down every 64^n ticks. Each worker owns its wheel outright.
+
+static void WheelAdd(WORKER *w, TASK *t)
+{
+    if (w->tick == 0)
+        w->tick = Nanoseconds() / TICK_NS;
+    uint64_t expires = t->expires;
+    if (expires < w->tick)
+        expires = w->tick;
+    uint64_t delta = expires - w->tick;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)WHEEL_SIZE << (level * WHEEL_BITS))
+        level++;
+    if (delta >= (uint64_t)WHEEL_SIZE << (level * WHEEL_BITS)) // beyond range: park in the last slot
+        expires = w->tick + ((uint64_t)WHEEL_SIZE << (level * WHEEL_BITS)) - 1;
+
+    ListPush(&w->wheel[level][(expires >> (level * WHEEL_BITS)) & WHEEL_MASK], t);
+}
+
+static int WheelCascade(WORKER *w, int level)
+{
+    int idx = (w->tick >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    TASKLIST l = w->wheel[level][idx];
+    w->wheel[level][idx].head = w->wheel[level][idx].tail = NULL;
+    while (TASK *t = ListPop(&l))
+        WheelAdd(w, t);
+    return idx;
+}
+
+/**
+ * @brief make every task whose timer has expired runnable
+ * @param now current tick
+ */
+static void WheelAdvance(WORKER *w, uint64_t now)
+{
+    if (w->tick == 0)
+        w->tick = now;
+    while (w->tick <= now)
+    {
+        int idx = w->tick & WHEEL_MASK;
+        for (int level = 1; idx == 0 && level < WHEEL_LEVELS; level++)
+            idx = WheelCascade(w, level);
+
+        TASKLIST *slot = &w->wheel[0][w->tick & WHEEL_MASK];
+        while (TASK *t = ListPop(slot))
+            Wake(t);
+        w->tick++;
+    }
+}
+
+/**
+ * @return first tick worth waking up for: the next occupied level-0 slot,
+ * or the next cascade if level 0 is empty
+ */
+static uint64_t WheelNext(WORKER *w)
+{
+    uint64_t tick = w->tick;
+    do
+    {
+        if (w->wheel[0][tick & WHEEL_MASK].head)
+            return tick;
+    } while (++tick & WHEEL_MASK);
+    return tick;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Events
+//
+// EventRaise is lock-free and may be called from any thread: it sets bits in
+// 'Signals' (the catchable state) and 'Pending' (the bits no worker has looked
+// at yet), then kicks an idle worker. Whichever worker drains 'Pending' wakes
+// the waiters on the per-event wait queues.
+
+#define NUM_EVENTS 32
+
+struct WAITNODE
+{
+    TASK *task;
+    WAITNODE *next, *prev;
 };
 
-static TASK Tasks[MAX_TASKS];
-static int NumTasks = 1;
-static unsigned Signals;
+struct WAITQUEUE
+{
+    WAITNODE *head, *tail;
+};
 
-void NextTask()
+static WAITQUEUE WaitQueue[NUM_EVENTS];
+static SPINLOCK EventLock;
+static std::atomic<unsigned> Signals(0);
+static std::atomic<unsigned> Pending(0);
+
+static void WaitLink(TASK *t)
+{
+    for (unsigned m = t->waiting; m; m &= m - 1)
+    {
+        int ev = __builtin_ctz(m);
+        WAITQUEUE *q = WaitQueue + ev;
+        WAITNODE *n = t->wait + ev;
+        n->task = t;
+        n->next = NULL;
+        n->prev = q->tail;
+        if (q->tail)
+            q->tail->next = n;
+        else
+            q->head = n;
+        q->tail = n;
+    }
+}
+
+static void WaitUnlink(TASK *t)
 {
-    static int id;
-    if (setjmp(Tasks[id].jb))
+    for (unsigned m = t->waiting; m; m &= m - 1)
+    {
+        int ev = __builtin_ctz(m);
+        WAITQUEUE *q = WaitQueue + ev;
+        WAITNODE *n = t->wait + ev;
+        if (n->prev)
+            n->prev->next = n->next;
+        else
+            q->head = n->next;
+        if (n->next)
+            n->next->prev = n->prev;
+        else
+            q->tail = n->prev;
+    }
+    t->waiting = 0;
+}
+
+static void EventDeliver()
+{
+    unsigned raised = Pending.exchange(0);
+    if (!raised)
         return;
-    if (++id == NumTasks)
-        id = 0;
-    longjmp(Tasks[id].jb, 1);
+
+    TASKLIST woken = {NULL, NULL};
+    EventLock.lock();
+    while (raised)
+    {
+        int ev = __builtin_ctz(raised);
+        raised &= raised - 1;
+        while (WAITNODE *n = WaitQueue[ev].head)
+        {
+            TASK *t = n->task;
+            WaitUnlink(t);
+            ListPush(&woken, t);
+        }
+    }
+    EventLock.unlock();
+
+    while (TASK *t = ListPop(&woken))
+        Wake(t);
+}
+
+void EventRaise(unsigned sigs)
+{
+    Signals.fetch_or(sigs);
+    Pending.fetch_or(sigs);
+
+    int n = NumWorkers.load(std::memory_order_relaxed);
+    for (int i = 0; i < n; i++)
+    {
+        WORKER *w = Workers[i];
+        if (w->idle.load())
+        {
+            w->kick.fetch_add(1);
+            Futex(&w->kick, FUTEX_WAKE_PRIVATE, 1, NULL);
+            break;
+        }
+    }
 }
 
-void CreateTask(void (*entry)())
+unsigned EventCatch(unsigned sigs)
 {
-    TASK *t = Tasks + NumTasks++;
-    t->pc = entry;
-    t->sp = t->stk + STACK_SIZE - 2;
-    for (int i = 6; i < 10; i++)
-        t->u[i] ^= __pointer_chk_guard;
+    return Signals.fetch_and(~sigs) & sigs;
 }
 
-unsigned Microseconds(void)
+///////////////////////////////////////////////////////////////////////////////
+// Scheduler
+
+static void IdleWait(WORKER *w, uint64_t ns)
 {
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+
+    w->idle.store(1);
+    unsigned seq = w->kick.load();
+    w->lock.lock();
+    bool runnable = w->mask != 0;
+    w->lock.unlock();
+    if (!runnable && !Pending.load())
+        Futex(&w->kick, FUTEX_WAIT_PRIVATE, seq, &ts);
+    w->idle.store(0);
+}
+
+/**
+ * @brief file a task that has just given up the CPU; runs on the scheduler
+ * context, so the task's own context is already saved
+ */
+static void Park(WORKER *w, TASK *t)
+{
+    switch (t->state)
+    {
+    case TASK_RUN:
+        Wake(t);
+        break;
+    case TASK_SLEEP:
+        WheelAdd(w, t);
+        break;
+    case TASK_WAIT:
+        // A raise may have slipped in since the task last looked.
+        EventLock.lock();
+        if (Signals.load() & t->waiting)
+            t->waiting = 0;
+        else
+            WaitLink(t);
+        EventLock.unlock();
+        if (!t->waiting)
+            Wake(t);
+        break;
+    case TASK_EXIT:
+        StackFree(t->stack);
+        delete t;
+        break;
+    }
 }
 
+static void SchedDump();
+
+/**
+ * @brief choose the next task for worker 'w', sleeping if there is none
+ * @param now in: current time; out: time the chosen task is dispatched
+ */
+static TASK *PickNext(WORKER *w, uint64_t *now_ns)
+{
+    uint64_t now = *now_ns;
+    for (;; now = Nanoseconds())
+    {
+        if (DumpRequested.load(std::memory_order_relaxed) && DumpRequested.exchange(false))
+            SchedDump();
+
+        WheelAdvance(w, now / TICK_NS);
+        EventDeliver();
+
+        TASK *next = RunPop(w);
+        if (!next)
+            next = Steal(w);
+        if (next)
+        {
+            TASK_STATS *st = &next->stats;
+            if (next->deadline)
+            {
+                if (now > next->deadline)
+                    st->misses++, DeadlineMisses++;
+                next->deadline = 0;
+            }
+            if (next->wake_at)
+            {
+                uint64_t late = now > next->wake_at ? now - next->wake_at : 0;
+                st->wakeups++;
+                st->wake_lat_ns += late;
+                st->wake_lat_max_ns = MAX(st->wake_lat_max_ns, late);
+                next->wake_at = 0;
+            }
+            st->switches++;
+            *now_ns = now;
+            return next;
+        }
+
+        // Nothing runnable: sleep until the next timer is due, an event is
+        // raised or another worker hands us a task.
+        uint64_t wake = WheelNext(w) * TICK_NS;
+        if (wake > now)
+            IdleWait(w, wake - now);
+    }
+}
+
+static void TaskStart()
+{
+    Current()->entry();
+    TaskExit();
+}
+
+/**
+ * @brief scheduler loop of a worker; every task switch goes through here
+ */
+static void SchedMain()
+{
+    setjmp(Me()->sched);
+
+    WORKER *w = Me();
+    uint64_t now = Nanoseconds();
+    if (TASK *prev = w->current)
+    {
+        uint64_t slice = now - w->dispatched;
+        prev->stats.run_ns += slice;
+        prev->stats.max_slice_ns = MAX(prev->stats.max_slice_ns, slice);
+        w->current = NULL;
+        Park(w, prev);
+    }
+
+    TASK *next = PickNext(w, &now);
+    w->dispatched = now;
+    w->current = next;
+    if (!next->fresh)
+        longjmp(next->jb, 1);
+
+    // First run: enter TaskStart on the task's own stack.
+    next->fresh = false;
+    getcontext(&w->boot);
+    w->boot.uc_stack.ss_sp = next->stack->base;
+    w->boot.uc_stack.ss_size = next->stack->size;
+    w->boot.uc_link = NULL;
+    makecontext(&w->boot, TaskStart, 0);
+    setcontext(&w->boot);
+}
+
+/**
+ * @brief save the calling task and enter the scheduler
+ * @param state why the task is giving up the CPU
+ */
+static void Switch(int state)
+{
+    WORKER *w = Me();
+    TASK *t = w->current;
+    t->state = state;
+    if (setjmp(t->jb))
+        return;
+    if (w->booted)
+        longjmp(w->sched, 1);
+
+    // Worker 0 gets its scheduler context on first use.
+    STACK *s = StackAlloc(SCHED_STACK);
+    w->booted = true;
+    getcontext(&w->boot);
+    w->boot.uc_stack.ss_sp = s->base;
+    w->boot.uc_stack.ss_size = s->size;
+    w->boot.uc_link = NULL;
+    makecontext(&w->boot, SchedMain, 0);
+    setcontext(&w->boot);
+}
+
+void NextTask()
+{
+    Switch(TASK_RUN);
+}
+
+/**
+ * @brief park the calling task on the timer wheel for at least 'ms'
+ */
 void TimerWait(unsigned ms)
 {
-    unsigned finish = Microseconds() + 1000 * ms;
+    uint64_t finish = Nanoseconds() + (uint64_t)ms * 1000000;
+    TASK *t = Current();
+    t->wake_at = finish;
+    t->expires = (finish + TICK_NS - 1) / TICK_NS;
+    Switch(TASK_SLEEP);
+}
+
+/**
+ * @brief park the calling task until any event in 'mask' is raised
+ * @return the events caught
+ */
+unsigned EventWait(unsigned mask)
+{
+    WAITNODE nodes[NUM_EVENTS];
     for (;;)
     {
-        NextTask();
-        int diff = finish - Microseconds();
-        if (diff <= 0)
-            break;
+        unsigned sigs = EventCatch(mask);
+        if (sigs || !mask)
+            return sigs;
+
+        TASK *t = Current();
+        t->waiting = mask;
+        t->wait = nodes;
+        Switch(TASK_WAIT);
     }
 }
 
-void EventRaise(unsigned sigs)
+/**
+ * @brief create a task on a pooled, guard-paged stack
+ * @param entry task body; returning from it ends the task
+ * @param stack stack size in bytes, rounded up to a power-of-two number of pages
+ * @return task id, or -1 if no stack could be mapped
+ */
+int CreateTask(void (*entry)(), unsigned stack)
 {
-    Signals |= sigs;
+    STACK *s = StackAlloc(stack);
+    if (!s)
+        return -1;
+
+    TASK *t = new TASK();
+    t->entry = entry;
+    t->stack = s;
+    t->fresh = true;
+    t->created = Nanoseconds();
+
+    TaskLock.lock();
+    size_t id = 1;
+    while (id < Tasks.size() && Tasks[id])
+        id++;
+    if (id == Tasks.size())
+        Tasks.push_back(t);
+    else
+        Tasks[id] = t;
+    t->id = id;
+    TaskLock.unlock();
+
+    Wake(t);
+    return id;
 }
 
-unsigned EventCatch(unsigned sigs)
+/**
+ * @brief end the calling task; its stack goes back to the pool
+ */
+void TaskExit()
+{
+    TASK *t = Current();
+    if (t == &MainTask)
+        exit(EXIT_SUCCESS);
+    TaskLock.lock();
+    Tasks[t->id] = NULL;
+    TaskLock.unlock();
+    Switch(TASK_EXIT);
+}
+
+int TaskSelf()
+{
+    return Current()->id;
+}
+
+// An exited task is taken out of Tasks[] under TaskLock before Park()
+// deletes it, so the result may only be used while TaskLock is held.
+// Stacks go back to the pool rather than being unmapped and stay readable.
+static TASK *TaskFind(int id)
+{
+    return id >= 0 && id < (int)Tasks.size() ? Tasks[id] : NULL;
+}
+
+static STACK *TaskStack(int id)
+{
+    TaskLock.lock();
+    TASK *t = TaskFind(id);
+    STACK *s = t ? t->stack : NULL;
+    TaskLock.unlock();
+    return s;
+}
+
+/**
+ * @return stack high-water mark of task 'id' in bytes (page granular),
+ * or 0 if there is no such task or it runs on the process stack
+ */
+size_t TaskStackUsage(int id)
+{
+    STACK *s = TaskStack(id);
+    return s ? StackUsage(s) : 0;
+}
+
+/**
+ * @brief set the priority of task 'id'; higher runs first
+ */
+void TaskPriority(int id, int prio)
+{
+    TaskLock.lock();
+    TASK *t = TaskFind(id);
+    if (t && prio >= 0 && prio < NUM_PRIOS)
+        t->prio = prio;
+    TaskLock.unlock();
+}
+
+/**
+ * @brief pin task 'id' to a worker (taken modulo the worker count) so its
+ * data stays in that core's cache, or unpin it with -1
+ */
+void TaskAffinity(int id, int worker)
+{
+    TaskLock.lock();
+    TASK *t = TaskFind(id);
+    if (t)
+        t->affinity = worker;
+    TaskLock.unlock();
+}
+
+/**
+ * @brief declare when the calling task must next be run, e.g. before a
+ * buffer it is waiting on is overwritten; cleared once it runs
+ * @param ns monotonic deadline from Nanoseconds(), 0 to clear
+ */
+void TaskDeadline(uint64_t ns)
+{
+    Current()->deadline = ns;
+}
+
+/**
+ * @return deadlines missed by task 'id', or by all tasks if 'id' < 0
+ */
+unsigned TaskDeadlineMisses(int id)
+{
+    if (id < 0)
+        return DeadlineMisses.load();
+    TaskLock.lock();
+    TASK *t = TaskFind(id);
+    unsigned misses = t ? t->stats.misses : 0;
+    TaskLock.unlock();
+    return misses;
+}
+
+/**
+ * @brief order tasks of equal priority earliest-deadline-first (default FIFO)
+ */
+void SchedEdf(bool on)
+{
+    Edf = on;
+}
+
+/**
+ * @brief name task 'id' for profiling output
+ */
+void TaskName(int id, const char *name)
+{
+    TaskLock.lock();
+    TASK *t = TaskFind(id);
+    if (t)
+    {
+        strncpy(t->name, name, sizeof(t->name) - 1);
+        t->name[sizeof(t->name) - 1] = 0;
+    }
+    TaskLock.unlock();
+}
+
+/**
+ * @return number of task ids handed out so far; ids run from 0 to this - 1
+ */
+int TaskCount()
+{
+    TaskLock.lock();
+    int num = Tasks.size();
+    TaskLock.unlock();
+    return num;
+}
+
+/**
+ * @brief snapshot the profiling counters of task 'id'
+ * @return false if there is no such task
+ */
+bool TaskStats(int id, TASK_STATS *st)
+{
+    TaskLock.lock();
+    TASK *t = TaskFind(id);
+    STACK *s = t ? t->stack : NULL;
+    if (t)
+    {
+        *st = t->stats;
+        st->created = t->created;
+        memcpy(st->name, t->name, sizeof(st->name));
+    }
+    TaskLock.unlock();
+    if (!t)
+        return false;
+    st->stack = s ? StackUsage(s) : 0;
+    return true;
+}
+
+static void SchedDump()
+{
+    uint64_t now = Nanoseconds();
+    int num = TaskCount();
+
+    Info("Tasks: {} workers, {} deadline misses", NumWorkers.load(), DeadlineMisses.load());
+    for (int id = 0; id < num; id++)
+    {
+        TASK_STATS st;
+        if (!TaskStats(id, &st))
+            continue;
+        uint64_t age = now - st.created;
+        Info("  {:>3} {:<15} run {:>9.3f}s {:>5.1f}% switches {:>9} max slice {:>7}us"
+             " wake lat avg {:>6}us max {:>7}us misses {} stack {}K",
+             id, st.name[0] ? st.name : "-", st.run_ns * 1e-9, age ? 100.0 * st.run_ns / age : 0.0, st.switches,
+             st.max_slice_ns / 1000, st.wakeups ? st.wake_lat_ns / st.wakeups / 1000 : 0,
+             st.wake_lat_max_ns / 1000, st.misses, st.stack / 1024);
+    }
+}
+
+static void DumpSignal(int)
+{
+    DumpRequested.store(true);
+}
+
+/**
+ * @brief dump task profiles to the log whenever 'sig' (e.g. SIGUSR1) arrives;
+ * the dump is written by the next scheduler pass, not the handler
+ */
+void SchedDumpOnSignal(int sig)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = DumpSignal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(sig, &sa, NULL);
+}
+
+static void *WorkerThread(void *arg)
+{
+    Self = (WORKER *)arg;
+    Self->booted = true;
+    SchedMain();
+    return NULL;
+}
+
+/**
+ * @brief start the M:N runtime: the caller becomes worker 0 and 'n' - 1
+ * more worker threads are started, each pinned to its own core
+ * @param n number of workers, 0 for one per online core
+ * @return number of workers running
+ */
+int SchedStart(int n)
+{
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = cpus;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+
+    for (int i = NumWorkers.load(); i < n; i++)
+    {
+        WORKER *w = new WORKER(i, NULL);
+        Workers[i] = w;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, WorkerThread, w))
+        {
+            delete w;
+            break;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(i % cpus, &set);
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+        pthread_detach(thread);
+        NumWorkers.store(i + 1);
+    }
+    return NumWorkers.load();
+}
+
+int SchedWorkers()
 {
-    sigs &= Signals;
-    Signals -= sigs;
-    return sigs;
+    return NumWorkers.load();
 }
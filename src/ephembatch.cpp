@@ -0,0 +1,240 @@
+#define LOG_MODULE LOG_MODULE_EPHEMERIS
+
+#include <math.h>
+#include <string.h>
+
+#include "ephembatch.h"
+
+typedef double VD __attribute__((vector_size(EPH_LANES * 8)));
+typedef int64_t VL __attribute__((vector_size(EPH_LANES * 8)));
+
+// The helpers return vectors by value; they are always inlined into the
+// kernel, so the warning about the AVX return ABI does not apply.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#define EPH_INLINE static inline __attribute__((always_inline))
+
+#if defined(__x86_64__) && !defined(__AVX2__)
+#define EPH_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define EPH_KERNEL
+#endif
+
+EPH_INLINE VD Load(const double *p)
+{
+    VD v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+EPH_INLINE void Store(double *p, const VD &v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+EPH_INLINE VD Splat(double d)
+{
+    return VD{} + d;
+}
+
+// Adding then subtracting 1.5 * 2^52 rounds to the nearest integer and
+// leaves it, two's complement, in the low mantissa bits.
+static const double ROUND_MAGIC = 6755399441055744.0;
+
+EPH_INLINE VD Round(const VD &x)
+{
+    return (x + ROUND_MAGIC) - ROUND_MAGIC;
+}
+
+// sin and cos together. Cody-Waite reduction by pi/2 in three parts, then the
+// Cephes minimax polynomials on [-pi/4, pi/4]; about 1 ulp for |x| < 1e6.
+EPH_INLINE void SinCos(const VD &x, VD *sin_x, VD *cos_x)
+{
+    const double PIO2_1 = 1.57079625129699707031e+00;
+    const double PIO2_2 = 7.54978941586159635335e-08;
+    const double PIO2_3 = 5.39030285815811905290e-15;
+
+    VD k = x * (2 / PI) + ROUND_MAGIC;
+    VL q = (VL)k; // quadrant in the low bits
+    k -= ROUND_MAGIC;
+    VD r = ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_3;
+    VD r2 = r * r;
+
+    VD s = Splat(1.58962301576546568060e-10);
+    s = s * r2 - 2.50507477628578072866e-8;
+    s = s * r2 + 2.75573136213857245213e-6;
+    s = s * r2 - 1.98412698295895385996e-4;
+    s = s * r2 + 8.33333333332211858878e-3;
+    s = s * r2 - 1.66666666666666307295e-1;
+    s = r + r * r2 * s;
+
+    VD c = Splat(-1.13585365213876817300e-11);
+    c = c * r2 + 2.08757008419747316778e-9;
+    c = c * r2 - 2.75573141792967388112e-7;
+    c = c * r2 + 2.48015872888517045348e-5;
+    c = c * r2 - 1.38888888888730564116e-3;
+    c = c * r2 + 4.16666666666665929218e-2;
+    c = 1 - 0.5 * r2 + r2 * r2 * c;
+
+    VL odd = (q & 1) != 0;
+    VD sin_r = odd ? c : s;
+    VD cos_r = odd ? s : c;
+    *sin_x = (q & 2) != 0 ? -sin_r : sin_r;
+    *cos_x = ((q + 1) & 2) != 0 ? -cos_r : cos_r;
+}
+
+// sin and cos of an angle known to be below about 1e-3 rad
+EPH_INLINE void SinCosSmall(const VD &d, VD *sin_d, VD *cos_d)
+{
+    VD d2 = d * d;
+    *sin_d = d * (1 - d2 / 6 * (1 - d2 / 20));
+    *cos_d = 1 - d2 / 2 * (1 - d2 / 12);
+}
+
+EPH_INLINE VD TimeFromEpoch(const VD &dt)
+{
+    VD t = dt > 302400 ? dt - 604800 : dt;
+    return t < -302400 ? t + 604800 : t;
+}
+
+/**
+ * @brief gather the constants of every valid ephemeris for EphemBatchEval
+ * @param eph ephemeris table, indexed by PRN
+ * @param num entries in 'eph'
+ * @return number of SVs loaded
+ */
+int EphemBatchLoad(EPH_BATCH *b, EPHEM eph[], int num)
+{
+    memset(b, 0, sizeof(*b)); // unused lanes evaluate harmlessly
+    for (int sv = 0; sv < num && b->num < NUM_SATS; sv++)
+    {
+        EPHEM &E = eph[sv];
+        if (!E.Valid())
+            continue;
+        int i = b->num++;
+        b->sv[i] = sv;
+        b->eph[i] = &E;
+        b->t_oe[i] = E.t_oe;
+        b->t_oc[i] = E.t_oc;
+        b->M_0[i] = E.M_0;
+        b->n[i] = E.n;
+        b->e[i] = E.e;
+        b->sqrt_1_e2[i] = E.sqrt_1_e2;
+        b->A[i] = E.A;
+        b->sin_w[i] = sin(E.omega);
+        b->cos_w[i] = cos(E.omega);
+        b->C_us[i] = E.C_us;
+        b->C_uc[i] = E.C_uc;
+        b->C_rs[i] = E.C_rs;
+        b->C_rc[i] = E.C_rc;
+        b->C_is[i] = E.C_is;
+        b->C_ic[i] = E.C_ic;
+        b->sin_i0[i] = sin(E.i_0);
+        b->cos_i0[i] = cos(E.i_0);
+        b->IDOT[i] = E.IDOT;
+        b->OMEGA_toe[i] = E.OMEGA_toe;
+        b->OMEGA_rate[i] = E.OMEGA_rate;
+        b->a_f0[i] = E.a_f[0];
+        b->a_f1[i] = E.a_f[1];
+        b->a_f2[i] = E.a_f[2];
+        b->t_gd[i] = E.t_gd;
+        b->F_e_sqrtA[i] = F * E.e * E.sqrtA;
+    }
+    return b->num;
+}
+
+// Same model as EPHEM::Evaluate, position and clock only, for EPH_LANES SVs.
+EPH_INLINE void EvalLanes(const EPH_BATCH *b, int i, double t, SV_BATCH *out)
+{
+    VD t_k = TimeFromEpoch(t - Load(b->t_oe + i));
+    VD e = Load(b->e + i);
+
+    // Mean anomaly, reduced to [-PI, PI]
+    VD M_k = Load(b->M_0 + i) + Load(b->n + i) * t_k;
+    M_k -= (2 * PI) * Round(M_k * (1 / (2 * PI)));
+
+    // Kepler's equation: series guess then two Newton steps (e < EPH_E_MAX)
+    VD s, c;
+    SinCos(M_k, &s, &c);
+    VD E_k = M_k + e * s * (1 + e * c);
+    for (int k = 0; k < 2; k++)
+    {
+        SinCos(E_k, &s, &c);
+        VD dE = (E_k - e * s - M_k) / (1 - e * c);
+        E_k -= dE;
+        VD s_k = s - c * dE;
+        c += s * dE;
+        s = s_k;
+    }
+
+    // True anomaly as sin/cos, then the argument of latitude by angle addition
+    VD one_ecosE = 1 - e * c;
+    VD sin_v = Load(b->sqrt_1_e2 + i) * s / one_ecosE;
+    VD cos_v = (c - e) / one_ecosE;
+    VD sin_w = Load(b->sin_w + i), cos_w = Load(b->cos_w + i);
+    VD sin_p = sin_v * cos_w + cos_v * sin_w;
+    VD cos_p = cos_v * cos_w - sin_v * sin_w;
+
+    // Second Harmonic Perturbations
+    VD sin_2u = 2 * sin_p * cos_p;
+    VD cos_2u = cos_p * cos_p - sin_p * sin_p;
+    VD du_k = Load(b->C_us + i) * sin_2u + Load(b->C_uc + i) * cos_2u;
+    VD dr_k = Load(b->C_rs + i) * sin_2u + Load(b->C_rc + i) * cos_2u;
+    VD di_k = Load(b->C_is + i) * sin_2u + Load(b->C_ic + i) * cos_2u;
+
+    // Corrected argument of latitude and inclination; both corrections are small angles
+    VD sin_d, cos_d;
+    SinCosSmall(du_k, &sin_d, &cos_d);
+    VD sin_u = sin_p * cos_d + cos_p * sin_d;
+    VD cos_u = cos_p * cos_d - sin_p * sin_d;
+    SinCosSmall(di_k + Load(b->IDOT + i) * t_k, &sin_d, &cos_d);
+    VD sin_i0 = Load(b->sin_i0 + i), cos_i0 = Load(b->cos_i0 + i);
+    VD sin_i = sin_i0 * cos_d + cos_i0 * sin_d;
+    VD cos_i = cos_i0 * cos_d - sin_i0 * sin_d;
+
+    // Positions in orbital plane
+    VD r_k = Load(b->A + i) * one_ecosE + dr_k;
+    VD x_kp = r_k * cos_u;
+    VD y_kp = r_k * sin_u;
+
+    // Corrected longitude of ascending node
+    VD sin_O, cos_O;
+    SinCos(Load(b->OMEGA_toe + i) + Load(b->OMEGA_rate + i) * t_k, &sin_O, &cos_O);
+
+    // Earth-fixed coordinates
+    Store(out->x + i, x_kp * cos_O - y_kp * cos_i * sin_O);
+    Store(out->y + i, x_kp * sin_O + y_kp * cos_i * cos_O);
+    Store(out->z + i, y_kp * sin_i);
+
+    // SV clock, relativistic term included
+    VD dt = TimeFromEpoch(t - Load(b->t_oc + i));
+    Store(out->clk_bias + i, Load(b->a_f0 + i) + (Load(b->a_f1 + i) + Load(b->a_f2 + i) * dt) * dt +
+                                 Load(b->F_e_sqrtA + i) * s - Load(b->t_gd + i));
+}
+
+EPH_KERNEL static void EvalAll(const EPH_BATCH *b, double t, SV_BATCH *out)
+{
+    for (int i = 0; i < b->num; i += EPH_LANES)
+        EvalLanes(b, i, t, out);
+}
+
+/**
+ * @brief positions and clock corrections of every SV in 'b' at time t
+ * @param t GPS time of week (s)
+ */
+void EphemBatchEval(const EPH_BATCH *b, double t, SV_BATCH *out)
+{
+    out->num = b->num;
+    memcpy(out->sv, b->sv, sizeof(out->sv));
+    EvalAll(b, t, out);
+
+    for (int i = 0; i < b->num; i++)
+    {
+        if (b->e[i] < EPH_E_MAX)
+            continue;
+        SV_STATE s = b->eph[i]->Evaluate(t);
+        out->x[i] = s.x;
+        out->y[i] = s.y;
+        out->z[i] = s.z;
+        out->clk_bias[i] = s.clk_bias;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef _EPHEMBATCH_H
+#define _EPHEMBATCH_H 1
+
+#include "gps.h"
+#include "ephemeris.h"
+
+//////////////////////////////////////////////////////////////
+// Batched orbit evaluation
+//
+// EphemBatchLoad() copies the constants of every valid ephemeris into SoA
+// arrays once; EphemBatchEval() then evaluates all of them at a time t,
+// EPH_LANES satellites per vector operation. The kernel is written with GCC
+// vector extensions, so the compiler emits AVX2 (selected at run time on
+// x86-64), NEON on AArch64 and plain scalar code where the FPU has no double
+// precision SIMD, as on the Cortex-A9. sin/cos are evaluated by polynomial,
+// and the true anomaly is carried as a sine/cosine pair instead of going
+// through atan2. Results agree with EPHEM::Evaluate to well under 1 mm.
+
+#define EPH_LANES 4
+#define EPH_E_MAX 0.1 // larger eccentricities use EPHEM::Evaluate
+
+struct EPH_BATCH
+{
+    int num; // SVs loaded
+    uint8_t sv[NUM_SATS];
+    EPHEM *eph[NUM_SATS];
+
+    alignas(32) double t_oe[NUM_SATS], t_oc[NUM_SATS];
+    alignas(32) double M_0[NUM_SATS], n[NUM_SATS], e[NUM_SATS], sqrt_1_e2[NUM_SATS], A[NUM_SATS];
+    alignas(32) double sin_w[NUM_SATS], cos_w[NUM_SATS];
+    alignas(32) double C_us[NUM_SATS], C_uc[NUM_SATS], C_rs[NUM_SATS], C_rc[NUM_SATS];
+    alignas(32) double C_is[NUM_SATS], C_ic[NUM_SATS];
+    alignas(32) double sin_i0[NUM_SATS], cos_i0[NUM_SATS], IDOT[NUM_SATS];
+    alignas(32) double OMEGA_toe[NUM_SATS], OMEGA_rate[NUM_SATS];
+    alignas(32) double a_f0[NUM_SATS], a_f1[NUM_SATS], a_f2[NUM_SATS], t_gd[NUM_SATS], F_e_sqrtA[NUM_SATS];
+};
+
+// Positions and clock corrections of the SVs of an EPH_BATCH, same order
+struct SV_BATCH
+{
+    int num;
+    uint8_t sv[NUM_SATS];
+    alignas(32) double x[NUM_SATS], y[NUM_SATS], z[NUM_SATS];
+    alignas(32) double clk_bias[NUM_SATS];
+};
+
+int EphemBatchLoad(EPH_BATCH *b, EPHEM eph[], int num);
+void EphemBatchEval(const EPH_BATCH *b, double t, SV_BATCH *out);
+
+#endif // _EPHEMBATCH_H
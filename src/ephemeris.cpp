@@ -1,11 +1,28 @@
+#define LOG_MODULE LOG_MODULE_EPHEMERIS
+
+#include <atomic>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "gps.h"
+#include "almanac.h"
 #include "ephemeris.h"
+#include "iono.h"
+#include "perf.h"
 
 EPHEM Ephemeris[NUM_SATS];
 
+// Published ephemerides, under a sequence lock: 'seq' is odd while the
+// copy is being written and 0 until the first publish.
+struct EPHEM_SLOT
+{
+    std::atomic<unsigned> seq;
+    EPHEM eph;
+};
+
+static EPHEM_SLOT Published[NUM_SATS];
+
 static double TimeFromEpoch(double t, double t_ref)
 {
     t -= t_ref;
@@ -16,155 +33,235 @@ static double TimeFromEpoch(double t, double t_ref)
     return t;
 }
 
-union PACK
+// Subframe 1
+constexpr NAV_FIELD SF1_WEEK = {NavBit(3, 1), 10, false, false, 1};
+constexpr NAV_FIELD SF1_T_GD = {NavBit(7, 17), 8, true, false, Pow2(-31)};
+constexpr NAV_FIELD SF1_IODC = {NavBit(8, 1), 8, false, false, 1};
+constexpr NAV_FIELD SF1_T_OC = {NavBit(8, 9), 16, false, false, Pow2(4)};
+constexpr NAV_FIELD SF1_A_F2 = {NavBit(9, 1), 8, true, false, Pow2(-55)};
+constexpr NAV_FIELD SF1_A_F1 = {NavBit(9, 9), 16, true, false, Pow2(-43)};
+constexpr NAV_FIELD SF1_A_F0 = {NavBit(10, 1), 22, true, false, Pow2(-31)};
+
+// Subframe 2
+constexpr NAV_FIELD SF2_IODE = {NavBit(3, 1), 8, false, false, 1};
+constexpr NAV_FIELD SF2_C_RS = {NavBit(3, 9), 16, true, false, Pow2(-5)};
+constexpr NAV_FIELD SF2_DN = {NavBit(4, 1), 16, true, true, Pow2(-43)};
+constexpr NAV_FIELD SF2_M_0 = {NavBit(4, 17), 32, true, true, Pow2(-31)};
+constexpr NAV_FIELD SF2_C_UC = {NavBit(6, 1), 16, true, false, Pow2(-29)};
+constexpr NAV_FIELD SF2_E = {NavBit(6, 17), 32, false, false, Pow2(-33)};
+constexpr NAV_FIELD SF2_C_US = {NavBit(8, 1), 16, true, false, Pow2(-29)};
+constexpr NAV_FIELD SF2_SQRT_A = {NavBit(8, 17), 32, false, false, Pow2(-19)};
+constexpr NAV_FIELD SF2_T_OE = {NavBit(10, 1), 16, false, false, Pow2(4)};
+
+// Subframe 3
+constexpr NAV_FIELD SF3_C_IC = {NavBit(3, 1), 16, true, false, Pow2(-29)};
+constexpr NAV_FIELD SF3_OMEGA_0 = {NavBit(3, 17), 32, true, true, Pow2(-31)};
+constexpr NAV_FIELD SF3_C_IS = {NavBit(5, 1), 16, true, false, Pow2(-29)};
+constexpr NAV_FIELD SF3_I_0 = {NavBit(5, 17), 32, true, true, Pow2(-31)};
+constexpr NAV_FIELD SF3_C_RC = {NavBit(7, 1), 16, true, false, Pow2(-5)};
+constexpr NAV_FIELD SF3_OMEGA = {NavBit(7, 17), 32, true, true, Pow2(-31)};
+constexpr NAV_FIELD SF3_OMEGA_DOT = {NavBit(9, 1), 24, true, true, Pow2(-43)};
+constexpr NAV_FIELD SF3_IODE = {NavBit(10, 1), 8, false, false, 1};
+constexpr NAV_FIELD SF3_IDOT = {NavBit(10, 9), 14, true, true, Pow2(-43)};
+
+#define NAV_PAGE_18 0x78 // data ID 1, SV ID 56
+
+void EPHEM::Subframe1(const uint32_t *nav)
 {
-    PACK(int a, int b = 0, int c = 0, int d = 0) { byte[3] = a, byte[2] = b, byte[1] = c, byte[0] = d; }
-    uint8_t byte[4];
-    unsigned u32;
-    signed s32;
-    unsigned u(int n) { return u32 >> (32 - n); }
-    signed s(int n) { return s32 >> (32 - n); }
-};
-
-void EPHEM::Subframe1(uint8_t *nav)
-{
-    week = PACK(nav[6], nav[7]).u(10);
-    t_gd = pow(2, -31) * PACK(nav[20]).s(8);
-    IODC = PACK(nav[21]).u(8);
-    t_oc = (1 << 4) * PACK(nav[22], nav[23]).u(16);
-    a_f[2] = pow(2, -55) * PACK(nav[24]).s(8);
-    a_f[1] = pow(2, -43) * PACK(nav[25], nav[26]).s(16);
-    a_f[0] = pow(2, -31) * PACK(nav[27], nav[28], nav[29]).s(22);
+    week = Bits(nav, SF1_WEEK);
+    t_gd = Field(nav, SF1_T_GD);
+    IODC = Bits(nav, SF1_IODC);
+    t_oc = Field(nav, SF1_T_OC);
+    a_f[2] = Field(nav, SF1_A_F2);
+    a_f[1] = Field(nav, SF1_A_F1);
+    a_f[0] = Field(nav, SF1_A_F0);
 }
 
-void EPHEM::Subframe2(uint8_t *nav)
+void EPHEM::Subframe2(const uint32_t *nav)
 {
-    IODE2 = PACK(nav[6]).u(8);
-    C_rs = pow(2, -5) * PACK(nav[7], nav[8]).s(16);
-    dn = pow(2, -43) * PACK(nav[9], nav[10]).s(16) * PI;
-    M_0 = pow(2, -31) * PACK(nav[11], nav[12], nav[13], nav[14]).s(32) * PI;
-    C_uc = pow(2, -29) * PACK(nav[15], nav[16]).s(16);
-    e = pow(2, -33) * PACK(nav[17], nav[18], nav[19], nav[20]).u(32);
-    C_us = pow(2, -29) * PACK(nav[21], nav[22]).s(16);
-    sqrtA = pow(2, -19) * PACK(nav[23], nav[24], nav[25], nav[26]).u(32);
-    t_oe = (1 << 4) * PACK(nav[27], nav[28]).u(16);
+    IODE2 = Bits(nav, SF2_IODE);
+    C_rs = Field(nav, SF2_C_RS);
+    dn = Field(nav, SF2_DN);
+    M_0 = Field(nav, SF2_M_0);
+    C_uc = Field(nav, SF2_C_UC);
+    e = Field(nav, SF2_E);
+    C_us = Field(nav, SF2_C_US);
+    sqrtA = Field(nav, SF2_SQRT_A);
+    t_oe = Field(nav, SF2_T_OE);
+    Derive();
 }
 
-void EPHEM::Subframe3(uint8_t *nav)
+void EPHEM::Subframe3(const uint32_t *nav)
 {
-    C_ic = pow(2, -29) * PACK(nav[6], nav[7]).s(16);
-    OMEGA_0 = pow(2, -31) * PACK(nav[8], nav[9], nav[10], nav[11]).s(32) * PI;
-    C_is = pow(2, -29) * PACK(nav[12], nav[13]).s(16);
-    i_0 = pow(2, -31) * PACK(nav[14], nav[15], nav[16], nav[17]).s(32) * PI;
-    C_rc = pow(2, -5) * PACK(nav[18], nav[19]).s(16);
-    omega = pow(2, -31) * PACK(nav[20], nav[21], nav[22], nav[23]).s(32) * PI;
-    OMEGA_dot = pow(2, -43) * PACK(nav[24], nav[25], nav[26]).s(24) * PI;
-    IODE3 = PACK(nav[27]).u(8);
-    IDOT = pow(2, -43) * PACK(nav[28], nav[29]).s(14) * PI;
+    C_ic = Field(nav, SF3_C_IC);
+    OMEGA_0 = Field(nav, SF3_OMEGA_0);
+    C_is = Field(nav, SF3_C_IS);
+    i_0 = Field(nav, SF3_I_0);
+    C_rc = Field(nav, SF3_C_RC);
+    omega = Field(nav, SF3_OMEGA);
+    OMEGA_dot = Field(nav, SF3_OMEGA_DOT);
+    IODE3 = Bits(nav, SF3_IODE);
+    IDOT = Field(nav, SF3_IDOT);
+    Derive();
 }
 
-// Ionospheric delay
-void EPHEM::LoadPage18(uint8_t *nav)
+// Orbit constants that only change with a new ephemeris. Called as each of
+// subframes 2 and 3 arrives, so they are consistent once both have.
+void EPHEM::Derive()
 {
-    alpha[0] = pow(2, -30) * PACK(nav[7]).s(8);
-    alpha[1] = pow(2, -27) * PACK(nav[8]).s(8);
-    alpha[2] = pow(2, -24) * PACK(nav[9]).s(8);
-    alpha[3] = pow(2, -24) * PACK(nav[10]).s(8);
-    beta[0] = pow(2, 11) * PACK(nav[11]).s(8);
-    beta[1] = pow(2, 14) * PACK(nav[12]).s(8);
-    beta[2] = pow(2, 16) * PACK(nav[13]).s(8);
-    beta[3] = pow(2, 16) * PACK(nav[14]).s(8);
+    // Semi-major axis
+    A = sqrtA * sqrtA;
+
+    // Computed mean motion (rad/sec), corrected
+    n = sqrt(MU / (A * A * A)) + dn;
+
+    sqrt_1_e2 = sqrt(1 - e * e);
+    OMEGA_rate = OMEGA_dot - OMEGA_E;
+    OMEGA_toe = OMEGA_0 - OMEGA_E * t_oe;
 }
 
-void EPHEM::Subframe4(uint8_t *nav)
+void EPHEM::Subframe4(const uint32_t *nav)
 {
-    if (PACK(nav[6]).u(8) == 0x78)
-        LoadPage18(nav);
+    if (Bits(nav, NAV_PAGE_ID) == NAV_PAGE_18)
+        IonoPage18(nav);
+    else
+        AlmanacPage(4, nav);
 }
 
-double EPHEM::EccentricAnomaly(double t_k)
+void EPHEM::Subframe5(const uint32_t *nav)
 {
-    // Semi-major axis
-    A = sqrtA * sqrtA;
-
-    // Computed mean motion (rad/sec)
-    double n_0 = sqrt(MU / (A * A * A));
-
-    // Corrected mean motion
-    double n = n_0 + dn;
+    AlmanacPage(5, nav);
+}
 
-    // Mean anomaly
-    double M_k = M_0 + n * t_k;
+#define KEPLER_ITER 6 // Newton steps; GPS orbits (e < 0.03) need 2
 
-    // Solve Kepler's Equation for Eccentric Anomaly
-    double E_k = M_k;
-    for (;;)
+// Solve Kepler's equation M = E - e sin E by Newton's method, starting from
+// the second-order series E = M + e sin M (1 + e cos M). The iteration count
+// is capped, so a corrupt 'e' costs a few extra steps, never a hang.
+// Returns E with its sine and cosine, which every caller needs next; they
+// are carried through the last step to first order, exact to O(dE^2).
+double EPHEM::EccentricAnomaly(double t_k, double *sin_E, double *cos_E)
+{
+    PERF_SCOPE perf(PERF_KEPLER);
+    // Mean anomaly, reduced to [-PI, PI]
+    double M_k = remainder(M_0 + n * t_k, 2 * PI);
+
+    double s, c;
+    sincos(M_k, &s, &c);
+    double E_k = M_k + e * s * (1 + e * c);
+    for (int i = 0; i < KEPLER_ITER; i++)
     {
-        double temp = E_k;
-        E_k = M_k + e * sin(E_k);
-        if (fabs(E_k - temp) < 1e-10)
+        sincos(E_k, &s, &c);
+        double dE = (E_k - e * s - M_k) / (1 - e * c);
+        E_k -= dE;
+        double s_k = s - c * dE;
+        c += s * dE;
+        s = s_k;
+        if (fabs(dE) < 1e-9) // quadratic convergence: E is now good to ~1e-18
             break;
     }
-
+    *sin_E = s;
+    *cos_E = c;
     return E_k;
 }
 
-// Get satellite position at time t
-void EPHEM::GetXYZ(double *x, double *y, double *z, double t)
+// SV clock correction and drift, 20.3.3.3.3.1 User Algorithm for SV Clock Correction
+void EPHEM::Clock(double t, double sin_E, double cos_E, double E_dot, SV_STATE *s)
+{
+    // Relativistic correction
+    s->rel = F * e * sqrtA * sin_E;
+    double rel_dot = F * e * sqrtA * cos_E * E_dot;
+
+    // Time from clock correction epoch
+    double dt = TimeFromEpoch(t, t_oc);
+
+    s->clk_bias = a_f[0] + (a_f[1] + a_f[2] * dt) * dt + s->rel - t_gd;
+    s->clk_drift = a_f[1] + 2 * a_f[2] * dt + rel_dot;
+}
+
+// Satellite position, velocity and clock at time t from one Kepler solve
+SV_STATE EPHEM::Evaluate(double t)
 {
+    SV_STATE s;
+
     // Time from ephemeris reference epoch
     double t_k = TimeFromEpoch(t, t_oe);
 
-    // Eccentric Anomaly
-    double E_k = EccentricAnomaly(t_k);
+    // Eccentric Anomaly and its rate
+    double sin_E, cos_E;
+    EccentricAnomaly(t_k, &sin_E, &cos_E);
+    double one_ecosE = 1 - e * cos_E;
+    double E_dot = n / one_ecosE;
 
-    // True Anomaly
-    double v_k = atan2(
-        sqrt(1 - e * e) * sin(E_k),
-        cos(E_k) - e);
+    // True Anomaly and its rate
+    double v_k = atan2(sqrt_1_e2 * sin_E, cos_E - e);
+    double v_dot = E_dot * sqrt_1_e2 / one_ecosE;
 
     // Argument of Latitude
     double AOL = v_k + omega;
 
     // Second Harmonic Perturbations
-    double du_k = C_us * sin(2 * AOL) + C_uc * cos(2 * AOL); // Argument of Latitude Correction
-    double dr_k = C_rs * sin(2 * AOL) + C_rc * cos(2 * AOL); // Radius Correction
-    double di_k = C_is * sin(2 * AOL) + C_ic * cos(2 * AOL); // Inclination Correction
+    double sin_2u, cos_2u;
+    sincos(2 * AOL, &sin_2u, &cos_2u);
+    double du_k = C_us * sin_2u + C_uc * cos_2u; // Argument of Latitude Correction
+    double dr_k = C_rs * sin_2u + C_rc * cos_2u; // Radius Correction
+    double di_k = C_is * sin_2u + C_ic * cos_2u; // Inclination Correction
 
-    // Corrected Argument of Latitude; Radius & Inclination
+    // Corrected Argument of Latitude; Radius & Inclination, and their rates
     double u_k = AOL + du_k;
-    double r_k = A * (1 - e * cos(E_k)) + dr_k;
+    double r_k = A * one_ecosE + dr_k;
     double i_k = i_0 + di_k + IDOT * t_k;
-
-    // Positions in orbital plane
-    double x_kp = r_k * cos(u_k);
-    double y_kp = r_k * sin(u_k);
+    double u_dot = v_dot * (1 + 2 * (C_us * cos_2u - C_uc * sin_2u));
+    double r_dot = A * e * sin_E * E_dot + 2 * v_dot * (C_rs * cos_2u - C_rc * sin_2u);
+    double i_dot = IDOT + 2 * v_dot * (C_is * cos_2u - C_ic * sin_2u);
+
+    // Positions and velocities in orbital plane
+    double sin_u, cos_u;
+    sincos(u_k, &sin_u, &cos_u);
+    double x_kp = r_k * cos_u;
+    double y_kp = r_k * sin_u;
+    double vx_kp = r_dot * cos_u - y_kp * u_dot;
+    double vy_kp = r_dot * sin_u + x_kp * u_dot;
 
     // Corrected longitude of ascending node
-    double OMEGA_k = OMEGA_0 + (OMEGA_dot - OMEGA_E) * t_k - OMEGA_E * t_oe;
+    double OMEGA_k = OMEGA_toe + OMEGA_rate * t_k;
 
     // Earth-fixed coordinates
-    *x = x_kp * cos(OMEGA_k) - y_kp * cos(i_k) * sin(OMEGA_k);
-    *y = x_kp * sin(OMEGA_k) + y_kp * cos(i_k) * cos(OMEGA_k);
-    *z = y_kp * sin(i_k);
+    double sin_O, cos_O, sin_i, cos_i;
+    sincos(OMEGA_k, &sin_O, &cos_O);
+    sincos(i_k, &sin_i, &cos_i);
+    s.x = x_kp * cos_O - y_kp * cos_i * sin_O;
+    s.y = x_kp * sin_O + y_kp * cos_i * cos_O;
+    s.z = y_kp * sin_i;
+
+    // Earth-fixed velocity
+    double vy_i = vy_kp * cos_i - y_kp * sin_i * i_dot;
+    s.vx = vx_kp * cos_O - vy_i * sin_O - s.y * OMEGA_rate;
+    s.vy = vx_kp * sin_O + vy_i * cos_O + s.x * OMEGA_rate;
+    s.vz = vy_kp * sin_i + y_kp * cos_i * i_dot;
+
+    Clock(t, sin_E, cos_E, E_dot, &s);
+    return s;
 }
 
-double EPHEM::GetClockCorrection(double t)
+// Get satellite position at time t
+void EPHEM::GetXYZ(double *x, double *y, double *z, double t)
 {
-    // Time from ephemeris reference epoch
-    double t_k = TimeFromEpoch(t, t_oe);
-
-    // Eccentric Anomaly
-    double E_k = EccentricAnomaly(t_k);
-
-    // Relativistic correction
-    double t_R = F * e * sqrtA * sin(E_k);
+    SV_STATE s = Evaluate(t);
+    *x = s.x;
+    *y = s.y;
+    *z = s.z;
+}
 
-    // Time from clock correction epoch
-    t = TimeFromEpoch(t, t_oc);
+// Get SV clock correction at time t
+double EPHEM::GetClockCorrection(double t)
+{
+    double sin_E, cos_E;
+    EccentricAnomaly(TimeFromEpoch(t, t_oe), &sin_E, &cos_E);
 
-    // 20.3.3.3.3.1 User Algorithm for SV Clock Correction
-    return a_f[0] + a_f[1] * pow(t, 1) + a_f[2] * pow(t, 2) + t_R - t_gd;
+    SV_STATE s;
+    Clock(t, sin_E, cos_E, n / (1 - e * cos_E), &s);
+    return s.clk_bias;
 }
 
 bool EPHEM::Valid()
@@ -207,41 +304,120 @@ void EPHEM::PrintAll()
     Debug("Ephemeris END**********************", 0);
 }
 
-// called from channel tasks
-void EPHEM::Subframe(uint8_t *buf)
+// 64-bit FNV-1a, a word at a time
+static uint64_t NavHash(const uint32_t *w, int n)
 {
-    uint8_t nav[30];
-    uint8_t id = (buf[49] << 2) + (buf[50] << 1) + buf[51];
+    uint64_t h = 0xcbf29ce484222325;
+    for (int i = 0; i < n; i++)
+        h = (h ^ w[i]) * 0x100000001b3;
+    return h;
+}
 
-    for (int i = 0; i < 30; buf += 6)
+// Subframes 1-3 repeat every 30 s with the same data for as long as an issue
+// is current, about 2 hours; only TLM and HOW, words 1 and 2, change. A
+// subframe whose issue number and remaining words match the last one of
+// its ID is not parsed again.
+bool EPHEM::Repeated(int id, const uint32_t *nav)
+{
+    uint64_t h = NavHash(nav + 2, NAV_WORDS - 2);
+    bool same = h == raw_hash[id - 1];
+    switch (id)
     {
-        for (int j = 0; j < 3; j++)
-        {
-            int byte = 0;
-            for (int k = 0; k < 8; k++)
-                byte += byte + *buf++;
-            nav[i++] = byte;
-        }
+    case 1:
+        same = same && Bits(nav, SF1_IODC) == IODC;
+        break;
+    case 2:
+        same = same && Bits(nav, SF2_IODE) == IODE2;
+        break;
+    case 3:
+        same = same && Bits(nav, SF3_IODE) == IODE3;
+        break;
     }
+    raw_hash[id - 1] = h;
+    return same;
+}
 
-    tow = PACK(nav[3], nav[4], nav[5]).u(17);
+/**
+ * @brief decode a subframe; called from channel tasks
+ * @param nav the ten parity checked words of the subframe
+ * @return true if it changed the ephemeris, false if a repeat or not decoded
+ */
+bool EPHEM::Subframe(const uint32_t *nav)
+{
+    uint8_t id = Bits(nav, NAV_SF_ID);
+    tow = Bits(nav, NAV_TOW);
 
     switch (id)
     {
     case 1:
+        if (Repeated(id, nav))
+            return false;
         Subframe1(nav);
-        break;
+        return true;
     case 2:
+        if (Repeated(id, nav))
+            return false;
         Subframe2(nav);
-        break;
+        return true;
     case 3:
+        if (Repeated(id, nav))
+            return false;
         Subframe3(nav);
+        return true;
+    case 4:
+        Subframe4(nav);
         break;
-        // case 4:
-        //     Subframe4(nav);
-        //     break;
-        // case 5:
-        //     Subframe5(nav);
-        //     break;
+    case 5:
+        Subframe5(nav);
+        break;
+    }
+    return false;
+}
+
+/**
+ * @brief publish the ephemeris assembled in Ephemeris[sv] if it is complete and new
+ * @return true if published
+ */
+bool EphemerisPublish(int sv)
+{
+    EPHEM &e = Ephemeris[sv];
+    EPHEM_SLOT &p = Published[sv];
+    if (!e.Valid())
+        return false; // subframes 1-3 not all from one issue yet
+
+    unsigned seq = p.seq.load(std::memory_order_relaxed);
+    if (seq && p.eph.Iode() == e.Iode())
+        return false; // already out
+
+    // Only the channel tracking 'sv' publishes it; the exchange just keeps a
+    // second one, briefly on the same SV, from interleaving with it.
+    if ((seq & 1) || !p.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed))
+        return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy((void *)&p.eph, &e, sizeof(EPHEM));
+    p.seq.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+/**
+ * @brief copy of the latest published ephemeris of an SV; never blocks the writer
+ * @return false if none has been published
+ */
+bool EphemerisGet(int sv, EPHEM *out)
+{
+    if (sv < 0 || sv >= NUM_SATS)
+        return false;
+    EPHEM_SLOT &p = Published[sv];
+    for (;;)
+    {
+        unsigned seq = p.seq.load(std::memory_order_acquire);
+        if (seq == 0)
+            return false;
+        if (seq & 1)
+            continue; // being written, for the time of a memcpy
+        memcpy((void *)out, (const void *)&p.eph, sizeof(EPHEM));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (p.seq.load(std::memory_order_relaxed) == seq)
+            return true;
     }
 }
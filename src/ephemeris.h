@@ -1,5 +1,18 @@
 #ifndef _EPHEMERIS_H
 #define _EPHEMERIS_H 1
+
+#include "navbits.h"
+
+// Satellite state at one instant, ECEF (WGS 84), from EPHEM::Evaluate
+struct SV_STATE
+{
+    double x, y, z;    // position (m)
+    double vx, vy, vz; // velocity (m/s), earth rotation included
+    double clk_bias;   // SV clock correction (s), relativistic term and T_GD included
+    double clk_drift;  // its rate (s/s)
+    double rel;        // relativistic part of clk_bias (s)
+};
+
 class EPHEM
 {
 private:
@@ -15,28 +28,49 @@ private:
     unsigned IODE3;
     double C_ic, OMEGA_0, C_is, i_0, C_rc, omega, OMEGA_dot, IDOT;
 
-    // Subframe 4, page 18 - Ionospheric delay
-    double alpha[4], beta[4];
-    void LoadPage18(uint8_t *nav);
+    // Derived from subframes 2 and 3 once, when they arrive
+    double n;          // corrected mean motion (rad/s)
+    double sqrt_1_e2;  // sqrt(1 - e^2)
+    double OMEGA_rate; // OMEGA_dot - OMEGA_E
+    double OMEGA_toe;  // OMEGA_0 - OMEGA_E * t_oe
+    void Derive();
+
+    // Hash of words 3-10 of the last subframes 1-3, to spot repeats
+    uint64_t raw_hash[3];
 
-    void Subframe1(uint8_t *nav);
-    void Subframe2(uint8_t *nav);
-    void Subframe3(uint8_t *nav);
-    void Subframe4(uint8_t *nav);
-    //  void Subframe5(uint8_t *nav);
+    bool Repeated(int id, const uint32_t *nav);
+    void Subframe1(const uint32_t *nav);
+    void Subframe2(const uint32_t *nav);
+    void Subframe3(const uint32_t *nav);
+    void Subframe4(const uint32_t *nav);
+    void Subframe5(const uint32_t *nav);
 
-    double EccentricAnomaly(double t_k);
+    double EccentricAnomaly(double t_k, double *sin_E, double *cos_E);
+    void Clock(double t, double sin_E, double cos_E, double E_dot, SV_STATE *s);
+
+    friend int EphemBatchLoad(struct EPH_BATCH *b, EPHEM eph[], int num);
 
 public:
     unsigned tow;
 
-    void Subframe(uint8_t *buf);
+    bool Subframe(const uint32_t *nav); // data bits d1..d24 of each word, D30* corrected
     bool Valid();
+    unsigned Iode() { return IODE2; }
+    unsigned Week() { return week; } // modulo 1024, as broadcast
+    SV_STATE Evaluate(double t);
     double GetClockCorrection(double t);
     void GetXYZ(double *x, double *y, double *z, double t);
     void PrintAll();
 };
 
+// Ephemerides being assembled, one per SV, written subframe by subframe by
+// the channel tracking it. Once subframes 1-3 of one issue are in, the
+// channel calls EphemerisPublish() and a copy goes out under a sequence
+// lock; solvers read it with EphemerisGet(), which never locks and never
+// returns a mix of two issues.
 extern EPHEM Ephemeris[];
 
+bool EphemerisPublish(int sv);
+bool EphemerisGet(int sv, EPHEM *out);
+
 #endif // _EPHEMERIS_H
\ No newline at end of file
@@ -5,9 +5,20 @@
 #include "logger.h"
 
 // #define CHANNEL_TEST
+// Follow the compile-time floor in logger.h, so code that only feeds a
+// stripped call is compiled out with it.
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_TRACE
+#define LOG_TRACE
+#endif
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_DEBUG
 #define LOG_DEBUG
+#endif
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_INFO
 #define LOG_INFO
+#endif
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_WARN
 #define LOG_WARN
+#endif
 #define LOG_ERROR
 #define LOG_CRITICAL
 
@@ -43,13 +54,57 @@ const double F = -4.442807633e-10; // -2*sqrt(MU)/pow(C,2)
 
 //////////////////////////////////////////////////////////////
 // Coroutines
+
+#define STACK_SIZE (32 * 1024) // default task stack (bytes)
+
+#define NUM_PRIOS 8
+#define PRIO_LOW 1     // logging, diagnostics
+#define PRIO_NORMAL 3  // solver, search
+#define PRIO_CHANNEL 6 // channel fetch, must beat the ping-pong buffer
+
+struct TASK_STATS
+{
+    uint64_t run_ns;          // total time running
+    uint64_t max_slice_ns;    // longest run between two switches
+    uint64_t wake_lat_ns;     // total lateness of timer wakeups
+    uint64_t wake_lat_max_ns; // worst lateness of a timer wakeup
+    unsigned switches;        // times switched in
+    unsigned wakeups;         // timer wakeups
+    unsigned misses;          // deadlines missed
+    size_t stack;             // stack high-water mark (bytes)
+    uint64_t created;         // ns, from Nanoseconds()
+    char name[16];            // see TaskName()
+};
+
 unsigned EventCatch(unsigned);
+unsigned EventWait(unsigned mask);
 void EventRaise(unsigned);
 void NextTask();
-void CreateTask(void (*entry)());
-unsigned Microseconds(void);
+int CreateTask(void (*entry)(), unsigned stack = STACK_SIZE);
+void TaskExit();
+int TaskSelf();
+size_t TaskStackUsage(int id);
+void TaskPriority(int id, int prio);
+void TaskAffinity(int id, int worker);
+void TaskDeadline(uint64_t ns);
+unsigned TaskDeadlineMisses(int id);
+void SchedEdf(bool on);
+void TaskName(int id, const char *name);
+int TaskCount();
+bool TaskStats(int id, TASK_STATS *st);
+void SchedDumpOnSignal(int sig);
+int SchedStart(int n);
+int SchedWorkers();
+uint64_t Nanoseconds(void);
+uint64_t Microseconds(void);
 void TimerWait(unsigned ms);
 
+//////////////////////////////////////////////////////////////
+// GPS time
+
+void GpsTimeSet(unsigned week, double tow, uint64_t ns);
+bool GpsTimeGet(uint64_t ns, unsigned *week, double *tow);
+
 //////////////////////////////////////////////////////////////
 // Search
 
@@ -62,9 +117,12 @@ void TimerWait(unsigned ms);
 //////////////////////////////////////////////////////////////
 // Tracking
 
+#define EVENT_CHAN_DATA(ch) (1u << (ch)) // new half of channel 'ch' ping-pong buffer
+
 void ChanReset();
 void ChanTask();
-void ChanStart(uint8_t ch, uint8_t sv);
+void ChanDataTask();
+bool ChanStart(uint8_t ch, uint8_t sv);
 #ifdef CHANNEL_TEST
 void DataInject(uint8_t ch, uint8_t *input);
 void TestBitSync(uint8_t ch);
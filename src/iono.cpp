@@ -0,0 +1,114 @@
+#define LOG_MODULE LOG_MODULE_EPHEMERIS
+
+#include <atomic>
+#include <math.h>
+
+#include "iono.h"
+
+// Subframe 4, page 18
+constexpr NAV_FIELD SF4_ALPHA[4] = {
+    {NavBit(3, 9), 8, true, false, Pow2(-30)},
+    {NavBit(3, 17), 8, true, false, Pow2(-27)},
+    {NavBit(4, 1), 8, true, false, Pow2(-24)},
+    {NavBit(4, 9), 8, true, false, Pow2(-24)},
+};
+constexpr NAV_FIELD SF4_BETA[4] = {
+    {NavBit(4, 17), 8, true, false, Pow2(11)},
+    {NavBit(5, 1), 8, true, false, Pow2(14)},
+    {NavBit(5, 9), 8, true, false, Pow2(16)},
+    {NavBit(5, 17), 8, true, false, Pow2(16)},
+};
+
+// alpha_0 .. alpha_3 then beta_0 .. beta_3, one byte each from the LSB up
+static std::atomic<uint64_t> Raw(0);
+static std::atomic<bool> Received(false);
+
+/**
+ * @brief store the Klobuchar coefficients of a subframe 4 page 18
+ */
+void IonoPage18(const uint32_t *nav)
+{
+    uint64_t raw = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        raw |= (uint64_t)Bits(nav, SF4_ALPHA[i]) << (8 * i);
+        raw |= (uint64_t)Bits(nav, SF4_BETA[i]) << (8 * i + 32);
+    }
+    if (raw != Raw.load(std::memory_order_relaxed))
+        Raw.store(raw, std::memory_order_relaxed);
+    if (!Received.load(std::memory_order_relaxed))
+        Received.store(true, std::memory_order_release);
+}
+
+/**
+ * @brief the latest broadcast coefficients, scaled
+ * @return false if no page 18 has been received yet
+ */
+bool IonoGet(IONO_PARAMS *p)
+{
+    if (!Received.load(std::memory_order_acquire))
+        return false;
+    uint64_t raw = Raw.load(std::memory_order_relaxed);
+    for (int i = 0; i < 4; i++)
+    {
+        p->alpha[i] = (int8_t)(raw >> (8 * i)) * SF4_ALPHA[i].scale;
+        p->beta[i] = (int8_t)(raw >> (8 * i + 32)) * SF4_BETA[i].scale;
+    }
+    return true;
+}
+
+// The model proper, with the user position already in semicircles.
+static inline double Klobuchar(const IONO_PARAMS &p, double phi_u, double lambda_u, double az, double el, double t)
+{
+    double E = el * (1 / PI);
+    double sin_A, cos_A;
+    sincos(az, &sin_A, &cos_A);
+
+    // Earth's central angle between user and ionospheric pierce point
+    double psi = 0.0137 / (E + 0.11) - 0.022;
+
+    // Pierce point latitude, longitude, and its geomagnetic latitude
+    double phi_i = MAX(-0.416, MIN(0.416, phi_u + psi * cos_A));
+    double lambda_i = lambda_u + psi * sin_A / cos(phi_i * PI);
+    double phi_m = phi_i + 0.064 * cos((lambda_i - 1.617) * PI);
+
+    // Local time at the pierce point
+    double t_loc = 4.32e4 * lambda_i + t;
+    t_loc -= 86400 * floor(t_loc * (1 / 86400.0));
+
+    // Obliquity factor
+    double d = 0.53 - E;
+    double F = 1 + 16 * d * d * d;
+
+    double AMP = p.alpha[0] + phi_m * (p.alpha[1] + phi_m * (p.alpha[2] + phi_m * p.alpha[3]));
+    double PER = p.beta[0] + phi_m * (p.beta[1] + phi_m * (p.beta[2] + phi_m * p.beta[3]));
+    AMP = MAX(AMP, 0.0);
+    PER = MAX(PER, 72000.0);
+
+    double x = 2 * PI * (t_loc - 50400) / PER;
+    if (fabs(x) >= 1.57)
+        return F * 5e-9; // night time
+    double x2 = x * x;
+    return F * (5e-9 + AMP * (1 - x2 / 2 * (1 - x2 / 12)));
+}
+
+/**
+ * @brief ionospheric delay of one SV
+ * @return L1 delay (s)
+ */
+double IonoDelay(const IONO_PARAMS &p, double lat, double lon, double az, double el, double t)
+{
+    return Klobuchar(p, lat * (1 / PI), lon * (1 / PI), az, el, t);
+}
+
+/**
+ * @brief ionospheric delays of all SVs of an epoch, seen from one position
+ * @param delay receives 'num' L1 delays (s)
+ */
+void IonoDelays(const IONO_PARAMS &p, double lat, double lon, const double az[], const double el[], int num, double t,
+                double delay[])
+{
+    double phi_u = lat * (1 / PI), lambda_u = lon * (1 / PI);
+    for (int i = 0; i < num; i++)
+        delay[i] = Klobuchar(p, phi_u, lambda_u, az[i], el[i], t);
+}
@@ -0,0 +1,31 @@
+#ifndef _IONO_H
+#define _IONO_H 1
+
+#include "navbits.h"
+
+//////////////////////////////////////////////////////////////
+// Ionospheric delay, Klobuchar model (IS-GPS-200 20.3.3.5.2.5)
+//
+// The alpha and beta coefficients of subframe 4 page 18 are the same from
+// every SV, so they are kept once. Their eight 8-bit fields fit a single
+// 64-bit word, which channels overwrite and readers load atomically; no
+// locking either side. Take a copy with IonoGet() once per epoch, then
+// IonoDelay() per SV or IonoDelays() for all of them.
+
+struct IONO_PARAMS
+{
+    double alpha[4]; // s, s/semicircle, s/semicircle^2, s/semicircle^3
+    double beta[4];  // s, s/semicircle, s/semicircle^2, s/semicircle^3
+};
+
+void IonoPage18(const uint32_t *nav);
+bool IonoGet(IONO_PARAMS *p);
+
+// Delays are L1 group delays in seconds; multiply by C for metres. The user
+// position is geodetic latitude and longitude, az/el those of the SV as
+// seen from it, all in radians; t is GPS time of week (s).
+double IonoDelay(const IONO_PARAMS &p, double lat, double lon, double az, double el, double t);
+void IonoDelays(const IONO_PARAMS &p, double lat, double lon, const double az[], const double el[], int num, double t,
+                double delay[]);
+
+#endif // _IONO_H
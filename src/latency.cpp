@@ -0,0 +1,203 @@
+#define LOG_MODULE LOG_MODULE_CHANNEL
+
+#include <atomic>
+#include <signal.h>
+#include <string.h>
+
+#include "gps.h"
+#include "latency.h"
+
+struct LAT_HIST
+{
+    std::atomic<uint32_t> bucket[LAT_BUCKETS];
+    std::atomic<uint64_t> count, sum, max;
+#ifdef LATENCY_PERF
+    PERF_COUNTS perf; // written by the owning channel only
+    uint64_t perf_n;
+#endif
+};
+
+static LAT_HIST Hists[NUM_CHANS][NUM_LAT_STAGES];
+static const char *const StageNames[NUM_LAT_STAGES] = {"fetch", "bit_sync", "bit_sample", "frame_sync", "subframe"};
+
+// Reference point for converting ticks to ns, taken at startup.
+static const uint64_t Cycles0 = Cycles(), Ns0 = Nanoseconds();
+
+static std::atomic<bool> DumpRequested(false);
+
+static inline unsigned BucketIndex(uint64_t v)
+{
+    if (v < (1 << LAT_SUB_BITS))
+        return v;
+    unsigned e = 63 - __builtin_clzll(v);
+    if (e > LAT_MAX_EXP)
+        return LAT_BUCKETS - 1;
+    unsigned sub = (v >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+    return (e - LAT_SUB_BITS + 1) << LAT_SUB_BITS | sub;
+}
+
+// Highest value that falls into bucket 'i'.
+static uint64_t BucketTop(unsigned i)
+{
+    if (i < (1 << LAT_SUB_BITS))
+        return i;
+    unsigned e = (i >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    uint64_t sub = i & ((1 << LAT_SUB_BITS) - 1);
+    return (((1 << LAT_SUB_BITS) + sub + 1) << (e - LAT_SUB_BITS)) - 1;
+}
+
+// Single writer per histogram, so plain load + store instead of read-modify-write.
+template <typename T>
+static inline void Bump(std::atomic<T> &a, T by)
+{
+    a.store(a.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+static double NsPerTick()
+{
+    uint64_t ticks = Cycles() - Cycles0;
+    return ticks ? (double)(Nanoseconds() - Ns0) / ticks : 1.0;
+}
+
+/**
+ * @brief add one timing to a channel's stage histogram
+ * @param ticks duration in Cycles() ticks
+ */
+void LatencyRecord(unsigned ch, LAT_STAGE stage, uint64_t ticks)
+{
+    if (ch >= NUM_CHANS)
+        return;
+    LAT_HIST &h = Hists[ch][stage];
+    Bump(h.bucket[BucketIndex(ticks)], 1u);
+    Bump(h.count, (uint64_t)1);
+    Bump(h.sum, ticks);
+    if (ticks > h.max.load(std::memory_order_relaxed))
+        h.max.store(ticks, std::memory_order_relaxed);
+}
+
+#ifdef LATENCY_PERF
+/**
+ * @brief add the hardware counts of one timed stage run
+ */
+void LatencyRecordPerf(unsigned ch, LAT_STAGE stage, const PERF_COUNTS &t0, const PERF_COUNTS &t1)
+{
+    if (ch >= NUM_CHANS)
+        return;
+    LAT_HIST &h = Hists[ch][stage];
+    PerfAccumulate(&h.perf, t0, t1);
+    h.perf_n++;
+}
+#endif
+
+static uint64_t Percentile(LAT_HIST &h, double p, double scale)
+{
+    uint64_t count = h.count.load(std::memory_order_relaxed);
+    uint64_t max = h.max.load(std::memory_order_relaxed);
+    uint64_t rank = (uint64_t)(p * count / 100.0 + 0.5), seen = 0;
+    for (unsigned i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += h.bucket[i].load(std::memory_order_relaxed);
+        if (seen && seen >= rank)
+            return (uint64_t)(MIN(BucketTop(i), max) * scale);
+    }
+    return (uint64_t)(max * scale);
+}
+
+/**
+ * @brief latency percentile of a channel stage
+ * @param p percentile, 0 to 100
+ * @return ns, at the resolution of the histogram bucket
+ */
+uint64_t LatencyPercentile(unsigned ch, LAT_STAGE stage, double p)
+{
+    if (ch >= NUM_CHANS)
+        return 0;
+    return Percentile(Hists[ch][stage], p, NsPerTick());
+}
+
+/**
+ * @brief log count, mean and percentiles of every stage that has run
+ */
+void LatencySummary()
+{
+    double scale = NsPerTick();
+    for (int ch = 0; ch < NUM_CHANS; ch++)
+    {
+        for (int s = 0; s < NUM_LAT_STAGES; s++)
+        {
+            LAT_HIST &h = Hists[ch][s];
+            uint64_t count = h.count.load(std::memory_order_relaxed);
+            if (!count)
+                continue;
+            Info("Latency ch{:<2} {:<10} n {:>8} mean {:>7}ns p50 {:>7}ns p99 {:>7}ns p99.9 {:>7}ns max {:>8}ns",
+                 ch, StageNames[s], count, (uint64_t)(h.sum.load(std::memory_order_relaxed) * scale / count),
+                 Percentile(h, 50, scale), Percentile(h, 99, scale), Percentile(h, 99.9, scale),
+                 (uint64_t)(h.max.load(std::memory_order_relaxed) * scale));
+#ifdef LATENCY_PERF
+            char what[32];
+            snprintf(what, sizeof(what), "ch%d %s", ch, StageNames[s]);
+            PerfLog(what, h.perf, h.perf_n);
+#endif
+        }
+    }
+#ifdef LATENCY_PERF
+    PerfKernelLog();
+#endif
+}
+
+/**
+ * @brief log the summary followed by every non-empty bucket
+ */
+void LatencyDump()
+{
+    double scale = NsPerTick();
+    Info("Latency dump, {:.3f} ns per tick", scale);
+    LatencySummary();
+    for (int ch = 0; ch < NUM_CHANS; ch++)
+    {
+        for (int s = 0; s < NUM_LAT_STAGES; s++)
+        {
+            LAT_HIST &h = Hists[ch][s];
+            for (unsigned i = 0; i < LAT_BUCKETS; i++)
+            {
+                uint32_t n = h.bucket[i].load(std::memory_order_relaxed);
+                if (n)
+                    Info("  ch{:<2} {:<10} <= {:>9}ns {:>8}", ch, StageNames[s], (uint64_t)(BucketTop(i) * scale), n);
+            }
+        }
+    }
+}
+
+static void DumpSignal(int)
+{
+    DumpRequested.store(true);
+}
+
+/**
+ * @brief have LatencyTask() dump the histograms whenever 'sig' (e.g. SIGUSR2) arrives
+ */
+void LatencyDumpOnSignal(int sig)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = DumpSignal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(sig, &sa, NULL);
+}
+
+/**
+ * @brief low priority task writing the periodic summary and requested dumps
+ */
+void LatencyTask()
+{
+    TaskName(TaskSelf(), "latency");
+    TaskPriority(TaskSelf(), PRIO_LOW);
+    for (unsigned sec = 1;; sec++)
+    {
+        TimerWait(1000);
+        if (DumpRequested.load(std::memory_order_relaxed) && DumpRequested.exchange(false))
+            LatencyDump();
+        else if (sec % LATENCY_PERIOD == 0)
+            LatencySummary();
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H 1
+
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////
+// Per-stage latency histograms
+//
+// Every channel pipeline stage is timed with the cheapest counter the CPU
+// offers and binned into a log-linear histogram: values below 8 ticks are
+// exact, above that each power of two is split into 8 buckets (12.5%
+// resolution). Each channel's histograms have a single writer, its own task,
+// so recording is a handful of relaxed loads and stores with no locks.
+// LatencyTask() logs a percentile summary every LATENCY_PERIOD seconds and
+// a full bucket dump on the signal given to LatencyDumpOnSignal().
+// Build with -DLATENCY_PERF to also accumulate hardware counters per stage
+// and per decoding kernel (see perf.h); each read is a system call, so this
+// is for profiling runs.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "perf.h"
+
+#ifndef LATENCY_PERIOD
+#define LATENCY_PERIOD 60 // seconds between summaries
+#endif
+
+#define LAT_SUB_BITS 3
+#define LAT_MAX_EXP 40 // values of 2^41 ticks and up share the top bucket
+#define LAT_BUCKETS ((LAT_MAX_EXP - LAT_SUB_BITS + 2) << LAT_SUB_BITS)
+
+enum LAT_STAGE
+{
+    LAT_FETCH,
+    LAT_BIT_SYNC,
+    LAT_BIT_SAMPLE,
+    LAT_FRAME_SYNC,
+    LAT_SUBFRAME,
+    NUM_LAT_STAGES
+};
+
+uint64_t Nanoseconds(void);
+
+// Free-running tick counter. The Cortex-A9 cycle counter is not readable from
+// user space unless the kernel enables it, so 32-bit ARM falls back to
+// Nanoseconds(); the scale to ns is measured at run time in every case.
+static inline uint64_t Cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return Nanoseconds();
+#endif
+}
+
+void LatencyRecord(unsigned ch, LAT_STAGE stage, uint64_t ticks);
+#ifdef LATENCY_PERF
+void LatencyRecordPerf(unsigned ch, LAT_STAGE stage, const PERF_COUNTS &t0, const PERF_COUNTS &t1);
+#endif
+uint64_t LatencyPercentile(unsigned ch, LAT_STAGE stage, double p);
+void LatencySummary();
+void LatencyDump();
+void LatencyDumpOnSignal(int sig);
+void LatencyTask();
+
+// Times the enclosing scope into one channel's histogram for 'stage'.
+struct LAT_SCOPE
+{
+    unsigned ch;
+    LAT_STAGE stage;
+    uint64_t t0;
+#ifdef LATENCY_PERF
+    PERF_COUNTS p0;
+    bool perf;
+
+    // The counter reads sit outside the timed interval.
+    LAT_SCOPE(unsigned c, LAT_STAGE s) : ch(c), stage(s)
+    {
+        perf = PerfRead(&p0);
+        t0 = Cycles();
+    }
+    ~LAT_SCOPE()
+    {
+        LatencyRecord(ch, stage, Cycles() - t0);
+        PERF_COUNTS p1;
+        if (perf && PerfRead(&p1))
+            LatencyRecordPerf(ch, stage, p0, p1);
+    }
+#else
+    LAT_SCOPE(unsigned c, LAT_STAGE s) : ch(c), stage(s), t0(Cycles()) {}
+    ~LAT_SCOPE() { LatencyRecord(ch, stage, Cycles() - t0); }
+#endif
+};
+
+#endif // _LATENCY_H
@@ -2,73 +2,371 @@
 #define _LOGGER_H 1
 
 #include <iostream>
+#include <atomic>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "spdlog/spdlog.h"
+#include "spdlog/async.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/sinks/basic_file_sink.h"
 
-#ifdef _WIN32
-#define __FILENAME__ (strrchr(__FILE__, '\\') ? (strrchr(__FILE__, '\\') + 1) : __FILE__)
+// Asynchronous logging: records are queued and formatted/written by a
+// dedicated thread, so a log call never waits on stdout or the SD card.
+// The overflow policy can be overridden at startup with
+// GPS_LOG_OVERFLOW=block|drop|overwrite. Dropping the newest record needs
+// spdlog 1.12 or later; with an older spdlog the default is to overwrite,
+// and asking for drop is a build error (LOG_OVERFLOW) or a startup warning
+// (GPS_LOG_OVERFLOW).
+#define LOG_OVERFLOW_BLOCK 0     // caller waits for room
+#define LOG_OVERFLOW_DROP 1      // newest record is discarded
+#define LOG_OVERFLOW_OVERWRITE 2 // oldest queued record is discarded
+
+#ifndef LOG_ASYNC
+#define LOG_ASYNC 1
+#endif
+#ifndef LOG_QUEUE_SIZE
+#define LOG_QUEUE_SIZE 8192
+#endif
+#ifndef LOG_OVERFLOW
+#if SPDLOG_VERSION >= 11200
+#define LOG_OVERFLOW LOG_OVERFLOW_DROP
 #else
-#define __FILENAME__ (strrchr(__FILE__, '/') ? (strrchr(__FILE__, '/') + 1) : __FILE__)
+#define LOG_OVERFLOW LOG_OVERFLOW_OVERWRITE
+#endif
+#endif
+#if LOG_ASYNC && LOG_OVERFLOW == LOG_OVERFLOW_DROP && SPDLOG_VERSION < 11200
+#error "LOG_OVERFLOW_DROP needs spdlog 1.12 or later"
 #endif
 
-#ifndef suffix
-#define suffix(msg) std::string(msg).append(" <").append(__FILENAME__).append(":").append(std::to_string(__LINE__)).append(" in ").append(__func__).append(">").c_str()
+// Compile-time floor: calls below it expand to nothing, arguments and all.
+// Release builds strip Trace(), which is used inside the per-fetch hot paths.
+#ifndef LOG_LEVEL_FLOOR
+#ifdef NDEBUG
+#define LOG_LEVEL_FLOOR SPDLOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL_FLOOR SPDLOG_LEVEL_TRACE
 #endif
+#endif
+
+// Runtime levels are kept per module. A source file selects its module by
+// defining LOG_MODULE before including gps.h. The table is set from
+// GPS_LOG_LEVEL and the file named by GPS_LOG_CONFIG (default LOG_CONFIG),
+// and the file is re-read on the signal given to Logger::ReloadOnSignal().
+// Both take "level" for every module and "module=level" entries, separated
+// by commas, blanks or newlines, e.g. "info,channel=trace,console=debug";
+// "console" and "file" set the sink levels.
+#define LOG_MODULE_MAIN 0
+#define LOG_MODULE_CHANNEL 1
+#define LOG_MODULE_EPHEMERIS 2
+#define LOG_MODULE_SCHED 3
+#define NUM_LOG_MODULES 4
 
-#ifndef num2str
-#define num2str(num) std::to_string(num)
+#ifndef LOG_MODULE
+#define LOG_MODULE LOG_MODULE_MAIN
+#endif
+#ifndef LOG_CONFIG
+#define LOG_CONFIG "logs/loglevel.conf"
 #endif
 
-template <typename T>
-std::string array2str(const T array[], size_t size)
+// Lazily formatted bit buffers. These only capture a pointer and length;
+// the bits are written straight into spdlog's format buffer, and only if
+// the record passes the level check, so a filtered Debug() costs nothing and
+// a logged one does no heap allocation.
+
+// Buffer of one bit per byte, written as "<n>:" then hex digits, 4 bits per
+// digit MSB first, last digit zero padded.
+struct BITS_HEX
 {
-    std::string str;
-    for (auto i = 0; i < size; i++)
-    {
-        str += num2str(array[i]);
-        str += ',';
-    }
-    return str;
+    const uint8_t *data;
+    size_t size;
+};
+
+// Buffer of one bit per byte, written as "<first bit>:" then the lengths of
+// the alternating runs, e.g. "1:20,40,20" for 20 ones, 40 zeros, 20 ones.
+struct BITS_RLE
+{
+    const uint8_t *data;
+    size_t size;
+};
+
+inline BITS_HEX BitsHex(const uint8_t bits[], size_t size)
+{
+    return BITS_HEX{bits, size};
 }
 
+inline BITS_RLE BitsRle(const uint8_t bits[], size_t size)
+{
+    return BITS_RLE{bits, size};
+}
+
+namespace fmt
+{
+    template <>
+    struct formatter<BITS_HEX>
+    {
+        template <typename ParseContext>
+        constexpr auto parse(ParseContext &ctx) -> decltype(ctx.begin()) { return ctx.begin(); }
+
+        template <typename FormatContext>
+        auto format(const BITS_HEX &b, FormatContext &ctx) const -> decltype(ctx.out())
+        {
+            auto out = format_to(ctx.out(), "{}:", b.size);
+            for (size_t i = 0; i < b.size; i += 4)
+            {
+                unsigned nibble = 0;
+                for (size_t j = i; j < i + 4; j++)
+                    nibble = nibble << 1 | (j < b.size && b.data[j]);
+                *out++ = "0123456789abcdef"[nibble];
+            }
+            return out;
+        }
+    };
+
+    template <>
+    struct formatter<BITS_RLE>
+    {
+        template <typename ParseContext>
+        constexpr auto parse(ParseContext &ctx) -> decltype(ctx.begin()) { return ctx.begin(); }
+
+        template <typename FormatContext>
+        auto format(const BITS_RLE &b, FormatContext &ctx) const -> decltype(ctx.out())
+        {
+            auto out = ctx.out();
+            if (!b.size)
+                return out;
+            out = format_to(out, "{}:", b.data[0] ? 1 : 0);
+            size_t run = 1;
+            for (size_t i = 1; i <= b.size; i++, run++)
+            {
+                if (i < b.size && !b.data[i] == !b.data[i - 1])
+                    continue;
+                out = format_to(out, "{}", run);
+                if (i < b.size)
+                    *out++ = ',';
+                run = 0;
+            }
+            return out;
+        }
+    };
+} // namespace fmt
+
+// The call site is passed as a source_loc (three pointers); it only shows up
+// in the output when TRACE_ON adds it to the pattern.
+#define LOG_CALL(lvl, ...)                                                                      \
+    do                                                                                          \
+    {                                                                                           \
+        Logger &log_ = Logger::GetInstance();                                                   \
+        if (log_.Enabled(LOG_MODULE, spdlog::level::lvl))                                       \
+            log_.GetLogger()->log(spdlog::source_loc{__FILE__, __LINE__, SPDLOG_FUNCTION},      \
+                                  spdlog::level::lvl, __VA_ARGS__);                             \
+    } while (0)
+
+#define LOG_STRIPPED(...) \
+    do                    \
+    {                     \
+    } while (0)
+
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_TRACE
+#define Trace(...) LOG_CALL(trace, __VA_ARGS__)
+#else
+#define Trace(...) LOG_STRIPPED()
+#endif
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_DEBUG
+#define Debug(...) LOG_CALL(debug, __VA_ARGS__)
+#else
+#define Debug(...) LOG_STRIPPED()
+#endif
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_INFO
+#define Info(...) LOG_CALL(info, __VA_ARGS__)
+#else
+#define Info(...) LOG_STRIPPED()
+#endif
+#if LOG_LEVEL_FLOOR <= SPDLOG_LEVEL_WARN
+#define Warn(...) LOG_CALL(warn, __VA_ARGS__)
+#else
+#define Warn(...) LOG_STRIPPED()
+#endif
+#define Error(...) LOG_CALL(err, __VA_ARGS__)
+#define Critical(...) LOG_CALL(critical, __VA_ARGS__)
+
 #ifdef TRACE_ON
-#define Debug(msg, ...) Logger::GetInstance().GetLogger()->debug(suffix(msg), __VA_ARGS__)
-#define Info(msg, ...) Logger::GetInstance().GetLogger()->info(suffix(msg), __VA_ARGS__)
-#define Warn(msg, ...) Logger::GetInstance().GetLogger()->warn(suffix(msg), __VA_ARGS__)
-#define Error(msg, ...) Logger::GetInstance().GetLogger()->error(suffix(msg), __VA_ARGS__)
-#define Critical(msg, ...) Logger::GetInstance().GetLogger()->critical(suffix(msg), __VA_ARGS__)
+#define LOG_PATTERN "[%Y-%m-%d %H:%M:%S.%e] [T%t] [%^%=8l%$] %v <%s:%# in %!>"
 #else
-#define Debug(...) Logger::GetInstance().GetLogger()->debug(__VA_ARGS__)
-#define Info(...) Logger::GetInstance().GetLogger()->info(__VA_ARGS__)
-#define Warn(...) Logger::GetInstance().GetLogger()->warn(__VA_ARGS__)
-#define Error(...) Logger::GetInstance().GetLogger()->error(__VA_ARGS__)
-#define Critical(...) Logger::GetInstance().GetLogger()->critical(__VA_ARGS__)
+#define LOG_PATTERN "[%Y-%m-%d %H:%M:%S.%e] [T%t] [%^%=8l%$] %v"
 #endif
 
 class Logger
 {
 private:
+    std::shared_ptr<spdlog::details::thread_pool> pool; // outlives 'logger'
     std::shared_ptr<spdlog::logger> logger;
+    spdlog::sink_ptr console_sink;
+    spdlog::sink_ptr file_sink;
+    std::atomic<uint8_t> levels[NUM_LOG_MODULES];
+    char config[256];                // level file, re-read on signal
+
+    static const char *ModuleName(int module)
+    {
+        static const char *const names[NUM_LOG_MODULES] = {"main", "channel", "ephemeris", "sched"};
+        return names[module];
+    }
+
+    // Level names are matched by hand rather than with spdlog::level::from_str
+    // because this also runs in a signal handler and must not allocate.
+    static int ParseLevel(const char *s, size_t n)
+    {
+        static const char *const names[] = {"trace", "debug", "info", "warn", "error", "critical", "off"};
+        for (int i = 0; i < 7; i++)
+            if (strlen(names[i]) == n && !strncmp(s, names[i], n))
+                return i;
+        return -1;
+    }
+
+    void SetLevel(const char *key, size_t klen, int level)
+    {
+        if (!klen)
+        {
+            for (int i = 0; i < NUM_LOG_MODULES; i++)
+                levels[i] = level;
+            return;
+        }
+        for (int i = 0; i < NUM_LOG_MODULES; i++)
+            if (strlen(ModuleName(i)) == klen && !strncmp(key, ModuleName(i), klen))
+                levels[i] = level;
+        if (klen == 7 && !strncmp(key, "console", 7))
+            console_sink->set_level((spdlog::level::level_enum)level);
+        if (klen == 4 && !strncmp(key, "file", 4))
+            file_sink->set_level((spdlog::level::level_enum)level);
+        // Only build records that at least one sink will write.
+        logger->set_level(std::min(console_sink->level(), file_sink->level()));
+    }
+
+    // Apply a level spec such as "info,channel=trace"; unknown entries are ignored.
+    void ParseLevels(const char *spec, size_t len)
+    {
+        size_t i = 0;
+        while (i < len)
+        {
+            while (i < len && strchr(", \t\r\n", spec[i]))
+                i++;
+            size_t start = i, eq = 0;
+            while (i < len && !strchr(", \t\r\n", spec[i]))
+            {
+                if (spec[i] == '=')
+                    eq = i;
+                i++;
+            }
+            if (i == start)
+                break;
+            if (eq)
+            {
+                int level = ParseLevel(spec + eq + 1, i - eq - 1);
+                if (level >= 0)
+                    SetLevel(spec + start, eq - start, level);
+            }
+            else
+            {
+                int level = ParseLevel(spec + start, i - start);
+                if (level >= 0)
+                    SetLevel(spec, 0, level);
+            }
+        }
+    }
+
+    // Uses only open/read/close so it is safe to call from a signal handler.
+    void LoadConfig()
+    {
+        char buf[1024];
+        int fd = open(config, O_RDONLY);
+        if (fd < 0)
+            return;
+        ssize_t n = read(fd, buf, sizeof(buf));
+        close(fd);
+        if (n > 0)
+            ParseLevels(buf, n);
+    }
+
+    static void ReloadSignal(int)
+    {
+        GetInstance().LoadConfig();
+    }
+
+    static int OverflowPolicy()
+    {
+        const char *env = getenv("GPS_LOG_OVERFLOW");
+        if (env && !strcmp(env, "block"))
+            return LOG_OVERFLOW_BLOCK;
+        if (env && !strcmp(env, "drop"))
+            return LOG_OVERFLOW_DROP;
+        if (env && !strcmp(env, "overwrite"))
+            return LOG_OVERFLOW_OVERWRITE;
+        return LOG_OVERFLOW;
+    }
 
     Logger()
     {
+        for (int i = 0; i < NUM_LOG_MODULES; i++)
+            levels[i] = spdlog::level::debug;
+        config[0] = 0;
         try
         {
             std::vector<spdlog::sink_ptr> sinks;
-            auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
-            console_sink->set_pattern("[%Y-%m-%d %H:%M:%S.%e] [T%t] [%^%=8l%$] %v");
+            console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+            console_sink->set_pattern(LOG_PATTERN);
             console_sink->set_level(spdlog::level::info);
             sinks.push_back(console_sink);
 
-            auto file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("logs/log.txt");
-            file_sink->set_pattern("[%Y-%m-%d %H:%M:%S.%e] [T%t] [%^%=8l%$] %v");
-            file_sink->set_level(spdlog::level::debug);
+            // The file takes everything the module table lets through.
+            file_sink = std::make_shared<spdlog::sinks::basic_file_sink_mt>("logs/log.txt");
+            file_sink->set_pattern(LOG_PATTERN);
+            file_sink->set_level(spdlog::level::trace);
             sinks.push_back(file_sink);
 
+#if LOG_ASYNC
+            pool = std::make_shared<spdlog::details::thread_pool>(LOG_QUEUE_SIZE, 1);
+            // Both discarding policies are decided inside the queue's own lock,
+            // so a full queue never blocks the caller.
+            int policy = OverflowPolicy();
+            switch (policy)
+            {
+#if SPDLOG_VERSION >= 11200
+            case LOG_OVERFLOW_DROP:
+                logger = std::make_shared<spdlog::async_logger>("multi_sink", begin(sinks), end(sinks), pool,
+                                                                spdlog::async_overflow_policy::discard_new);
+                break;
+#else
+            case LOG_OVERFLOW_DROP:
+#endif
+            case LOG_OVERFLOW_OVERWRITE:
+                logger = std::make_shared<spdlog::async_logger>("multi_sink", begin(sinks), end(sinks), pool,
+                                                                spdlog::async_overflow_policy::overrun_oldest);
+                break;
+            default:
+                logger = std::make_shared<spdlog::async_logger>("multi_sink", begin(sinks), end(sinks), pool,
+                                                                spdlog::async_overflow_policy::block);
+                break;
+            }
+#else
             logger = std::make_shared<spdlog::logger>("multi_sink", begin(sinks), end(sinks));
-            logger->set_level(spdlog::level::debug);
+#endif
+            logger->set_level(spdlog::level::trace);
             logger->flush_on(spdlog::level::warn);
+#if LOG_ASYNC && SPDLOG_VERSION < 11200
+            if (policy == LOG_OVERFLOW_DROP)
+                logger->warn("GPS_LOG_OVERFLOW=drop needs spdlog 1.12 or later, overwriting the oldest records instead");
+#endif
+
+            // Config file first, then the environment.
+            const char *path = getenv("GPS_LOG_CONFIG");
+            snprintf(config, sizeof(config), "%s", path ? path : LOG_CONFIG);
+            LoadConfig();
+            const char *env = getenv("GPS_LOG_LEVEL");
+            if (env)
+                ParseLevels(env, strlen(env));
         }
         catch (const spdlog::spdlog_ex &ex)
         {
@@ -83,10 +381,37 @@ public:
         return logger_instance;
     }
 
-    std::shared_ptr<spdlog::logger> GetLogger()
+    const std::shared_ptr<spdlog::logger> &GetLogger()
     {
         return logger;
     }
+
+    bool Enabled(int module, spdlog::level::level_enum level)
+    {
+        return level >= levels[module].load(std::memory_order_relaxed);
+    }
+
+    // Re-read the level file whenever 'sig' arrives (e.g. SIGHUP).
+    void ReloadOnSignal(int sig)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = ReloadSignal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(sig, &sa, NULL);
+    }
+
+    // Records lost to a full queue, under either discarding policy.
+    size_t Dropped()
+    {
+        if (!pool)
+            return 0;
+#if SPDLOG_VERSION >= 11200
+        return pool->overrun_counter() + pool->discard_counter();
+#else
+        return pool->overrun_counter();
+#endif
+    }
 };
 
 #endif // _LOGGER_H
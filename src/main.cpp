@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <signal.h>
 
 #include "gps.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define RECV_MAX 1000
 
@@ -11,8 +15,16 @@ extern uint8_t prompt_i[];
 int main()
 {
     uint8_t ch = 0;
+    SchedDumpOnSignal(SIGUSR1);
+    Logger::GetInstance().ReloadOnSignal(SIGHUP);
+    TraceOpen();
+    LatencyDumpOnSignal(SIGUSR2);
+    CreateTask(LatencyTask);
+    CreateTask(MetricsTask);
     ChanReset();
     ChanStart(ch, 1);
+    CreateTask(ChanDataTask);
+    SchedStart(0); // one worker per core; main() carries on as worker 0
     ChanTask();
 
 #ifdef CHANNEL_TEST
@@ -25,5 +37,6 @@ int main()
     }
 #endif
 
+    TraceClose();
     return 0;
 }
\ No newline at end of file
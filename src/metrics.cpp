@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "gps.h"
+#include "metrics.h"
+
+CHAN_METRICS ChanMetrics[NUM_CHANS];
+SV_METRICS SvMetrics[NUM_SATS];
+
+typedef fmt::memory_buffer METRICS_BUF;
+
+static void Family(METRICS_BUF &out, const char *name, const char *type, const char *help)
+{
+    fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+static void ChanCounter(METRICS_BUF &out, const char *name, const char *help,
+                        std::atomic<uint64_t> CHAN_METRICS::*field)
+{
+    Family(out, name, "counter", help);
+    for (int ch = 0; ch < NUM_CHANS; ch++)
+        fmt::format_to(std::back_inserter(out), "{}{{ch=\"{}\"}} {}\n", name, ch,
+                       (ChanMetrics[ch].*field).load(std::memory_order_relaxed));
+}
+
+static void Render(METRICS_BUF &out)
+{
+    uint64_t now = Nanoseconds();
+
+    ChanCounter(out, "gps_chan_buffers_fetched_total", "Sample buffers read from the PL.", &CHAN_METRICS::fetched);
+    ChanCounter(out, "gps_chan_buffer_overruns_total", "Sample buffers overwritten before they were read.",
+                &CHAN_METRICS::overruns);
+    ChanCounter(out, "gps_chan_bit_sync_attempts_total", "Bit sync attempts.", &CHAN_METRICS::bit_sync_attempts);
+    ChanCounter(out, "gps_chan_bit_syncs_total", "Successful bit syncs.", &CHAN_METRICS::bit_syncs);
+    ChanCounter(out, "gps_chan_parity_failures_total", "Subframes with a preamble but bad word parity.",
+                &CHAN_METRICS::parity_failures);
+    ChanCounter(out, "gps_chan_subframes_total", "Subframes decoded.", &CHAN_METRICS::subframes);
+
+    Family(out, "gps_sv_subframes_total", "counter", "Subframes decoded per satellite.");
+    for (int sv = 0; sv < NUM_SATS; sv++)
+    {
+        uint64_t n = SvMetrics[sv].subframes.load(std::memory_order_relaxed);
+        if (n)
+            fmt::format_to(std::back_inserter(out), "gps_sv_subframes_total{{sv=\"{}\"}} {}\n", sv, n);
+    }
+
+    Family(out, "gps_sv_subframe_repeats_total", "counter",
+           "Subframes 1-3 identical to the last ones, not decoded again.");
+    for (int sv = 0; sv < NUM_SATS; sv++)
+    {
+        uint64_t n = SvMetrics[sv].repeats.load(std::memory_order_relaxed);
+        if (n)
+            fmt::format_to(std::back_inserter(out), "gps_sv_subframe_repeats_total{{sv=\"{}\"}} {}\n", sv, n);
+    }
+
+    Family(out, "gps_sv_ephemeris_age_seconds", "gauge", "Time since the current ephemeris was published.");
+    for (int sv = 0; sv < NUM_SATS; sv++)
+    {
+        uint64_t t = SvMetrics[sv].ephem_ns.load(std::memory_order_relaxed);
+        if (t)
+            fmt::format_to(std::back_inserter(out), "gps_sv_ephemeris_age_seconds{{sv=\"{}\"}} {:.3f}\n", sv,
+                           (now - t) * 1e-9);
+    }
+
+    unsigned week;
+    double tow;
+    if (GpsTimeGet(now, &week, &tow))
+    {
+        Family(out, "gps_time_week", "gauge", "GPS week (modulo 1024), from subframe 1.");
+        fmt::format_to(std::back_inserter(out), "gps_time_week {}\n", week);
+        Family(out, "gps_time_of_week_seconds", "gauge", "GPS time of week, anchored at the last decoded TOW.");
+        fmt::format_to(std::back_inserter(out), "gps_time_of_week_seconds {:.3f}\n", tow);
+    }
+
+    int num = TaskCount();
+    std::vector<TASK_STATS> st(num);
+    std::vector<bool> ok(num);
+    for (int id = 0; id < num; id++)
+        ok[id] = TaskStats(id, &st[id]);
+
+    Family(out, "gps_task_run_seconds_total", "counter", "CPU time spent running each task.");
+    for (int id = 0; id < num; id++)
+        if (ok[id])
+            fmt::format_to(std::back_inserter(out), "gps_task_run_seconds_total{{id=\"{}\",task=\"{}\"}} {:.6f}\n",
+                           id, st[id].name, st[id].run_ns * 1e-9);
+    Family(out, "gps_task_switches_total", "counter", "Times each task was switched in.");
+    for (int id = 0; id < num; id++)
+        if (ok[id])
+            fmt::format_to(std::back_inserter(out), "gps_task_switches_total{{id=\"{}\",task=\"{}\"}} {}\n", id,
+                           st[id].name, st[id].switches);
+    Family(out, "gps_task_deadline_misses_total", "counter", "Deadlines each task missed.");
+    for (int id = 0; id < num; id++)
+        if (ok[id])
+            fmt::format_to(std::back_inserter(out), "gps_task_deadline_misses_total{{id=\"{}\",task=\"{}\"}} {}\n",
+                           id, st[id].name, st[id].misses);
+    Family(out, "gps_task_max_slice_seconds", "gauge", "Longest run of each task between two switches.");
+    for (int id = 0; id < num; id++)
+        if (ok[id])
+            fmt::format_to(std::back_inserter(out), "gps_task_max_slice_seconds{{id=\"{}\",task=\"{}\"}} {:.6f}\n",
+                           id, st[id].name, st[id].max_slice_ns * 1e-9);
+
+    Family(out, "gps_log_dropped_total", "counter", "Log records lost to a full queue.");
+    fmt::format_to(std::back_inserter(out), "gps_log_dropped_total {}\n", Logger::GetInstance().Dropped());
+}
+
+// Never blocks: a client that does not drain its socket gets a truncated reply.
+static void Serve(int fd)
+{
+    METRICS_BUF out;
+    Render(out);
+    const char *p = out.data();
+    size_t left = out.size();
+    while (left)
+    {
+        ssize_t n = send(fd, p, left, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+    close(fd);
+}
+
+static int Listen(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief low priority task serving metrics on METRICS_SOCKET (or GPS_METRICS_SOCKET);
+ * the listening socket is polled so the worker thread never blocks in accept()
+ */
+void MetricsTask()
+{
+    TaskName(TaskSelf(), "metrics");
+    TaskPriority(TaskSelf(), PRIO_LOW);
+
+    const char *path = getenv("GPS_METRICS_SOCKET");
+    if (!path)
+        path = METRICS_SOCKET;
+    int lfd = Listen(path);
+    if (lfd < 0)
+    {
+        Error("Metrics socket {}: {}", path, strerror(errno));
+        TaskExit();
+    }
+
+    for (;;)
+    {
+        TimerWait(METRICS_POLL_MS);
+        int fd;
+        while ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+            Serve(fd);
+    }
+}
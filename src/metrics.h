@@ -0,0 +1,49 @@
+#ifndef _METRICS_H
+#define _METRICS_H 1
+
+#include <atomic>
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////
+// Receiver metrics
+//
+// Counters are bumped in place by the channel pipeline. MetricsTask() serves
+// a snapshot in the Prometheus text format to every client that connects to
+// a Unix domain socket, e.g. 'socat - UNIX-CONNECT:/tmp/gps-metrics.sock'
+// from a node exporter textfile job, then closes the connection.
+
+#ifndef METRICS_SOCKET
+#define METRICS_SOCKET "/tmp/gps-metrics.sock"
+#endif
+#ifndef METRICS_POLL_MS
+#define METRICS_POLL_MS 200 // accept() poll interval
+#endif
+
+struct CHAN_METRICS
+{
+    std::atomic<uint64_t> fetched;           // buffers read from the PL
+    std::atomic<uint64_t> overruns;          // buffers overwritten before they were read
+    std::atomic<uint64_t> bit_sync_attempts; // BitSync() runs while unsynced
+    std::atomic<uint64_t> bit_syncs;         // of which succeeded
+    std::atomic<uint64_t> parity_failures;   // preamble found, word parity bad
+    std::atomic<uint64_t> subframes;         // subframes decoded
+};
+
+struct SV_METRICS
+{
+    std::atomic<uint64_t> subframes; // subframes decoded
+    std::atomic<uint64_t> repeats;   // of which subframes 1-3 unchanged since last time, not parsed again
+    std::atomic<uint64_t> ephem_ns;  // Nanoseconds() when an ephemeris was last published
+};
+
+extern CHAN_METRICS ChanMetrics[];
+extern SV_METRICS SvMetrics[];
+
+static inline void MetricAdd(std::atomic<uint64_t> &counter, uint64_t n = 1)
+{
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+void MetricsTask();
+
+#endif // _METRICS_H
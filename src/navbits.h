@@ -0,0 +1,74 @@
+#ifndef _NAVBITS_H
+#define _NAVBITS_H 1
+
+#include <stdint.h>
+
+#include "gps.h"
+
+//////////////////////////////////////////////////////////////
+// Navigation message fields
+//
+// A subframe reaches the decoders as NAV_WORDS words holding data bits
+// d1..d24 of each word, parity removed and D30* corrected, d1 at bit 23.
+// Fields are described by constexpr NAV_FIELDs and pulled out with Bits()
+// or Field(); the tables live with the decoder of each subframe.
+
+#define NAV_WORDS 10 // per subframe, 24 data bits each
+
+// One field of a navigation message subframe: where it sits among the 240
+// data bits (parity removed, MSB first) and how its LSB scales.
+struct NAV_FIELD
+{
+    uint8_t bit, len; // offset and width (<= 32)
+    bool sign;        // two's complement
+    bool semi;        // semicircles: multiply by PI to get radians
+    double scale;     // value of the LSB
+};
+
+// IS-GPS-200 numbering: word 1-10, data bit 1-24 of the word
+constexpr uint8_t NavBit(int word, int bit)
+{
+    return 24 * (word - 1) + bit - 1;
+}
+
+constexpr double Pow2(int n)
+{
+    return n == 0 ? 1.0 : n > 0 ? 2 * Pow2(n - 1) : 0.5 * Pow2(n + 1);
+}
+
+// Fields common to all subframes
+constexpr NAV_FIELD NAV_TOW = {NavBit(2, 1), 17, false, false, 1};
+constexpr NAV_FIELD NAV_SF_ID = {NavBit(2, 20), 3, false, false, 1};
+
+// Subframes 4 and 5: every page starts with a data ID and an SV (page) ID
+constexpr NAV_FIELD NAV_PAGE_ID = {NavBit(3, 1), 8, false, false, 1}; // both together
+constexpr NAV_FIELD NAV_DATA_ID = {NavBit(3, 1), 2, false, false, 1};
+constexpr NAV_FIELD NAV_SV_ID = {NavBit(3, 3), 6, false, false, 1};
+
+#define NAV_DATA_ID_GPS 1
+
+// Field bits moved to the top of a 64-bit word. A field spans at most two
+// words, so the word it starts in and the next one always hold all of it.
+static inline uint64_t FieldTop(const uint32_t *nav, const NAV_FIELD &f)
+{
+    int w = f.bit / 24;
+    uint64_t v = (uint64_t)nav[w] << 24 | (w < NAV_WORDS - 1 ? nav[w + 1] : 0);
+    return v << (16 + f.bit % 24);
+}
+
+// Raw field value, unsigned
+static inline unsigned Bits(const uint32_t *nav, const NAV_FIELD &f)
+{
+    return FieldTop(nav, f) >> (64 - f.len);
+}
+
+// Field value in its units (radians for semicircle fields)
+static inline double Field(const uint32_t *nav, const NAV_FIELD &f)
+{
+    uint64_t v = FieldTop(nav, f);
+    double d = f.sign ? (double)((int64_t)v >> (64 - f.len)) : (double)(v >> (64 - f.len));
+    d *= f.scale;
+    return f.semi ? d * PI : d;
+}
+
+#endif // _NAVBITS_H
@@ -0,0 +1,105 @@
+#define LOG_MODULE LOG_MODULE_EPHEMERIS
+
+#include <math.h>
+#include <string.h>
+
+#include "orbitcache.h"
+
+// Interpolate over [t0, t0 + ORBIT_SPAN] at the Chebyshev nodes of the
+// first kind.
+static void Fit(ORBIT_FIT *f, EPHEM &eph, double t0)
+{
+    const int M = ORBIT_DEGREE + 1;
+    double v[NUM_ORBIT_SERIES][M];
+
+    for (int k = 0; k < M; k++)
+    {
+        double x = cos(PI * (k + 0.5) / M);
+        SV_STATE s = eph.Evaluate(t0 + (x + 1) * (ORBIT_SPAN / 2));
+        v[ORBIT_X][k] = s.x;
+        v[ORBIT_Y][k] = s.y;
+        v[ORBIT_Z][k] = s.z;
+        v[ORBIT_CLK][k] = s.clk_bias;
+        v[ORBIT_REL][k] = s.rel;
+    }
+
+    for (int j = 0; j < M; j++)
+    {
+        double w[M];
+        for (int k = 0; k < M; k++)
+            w[k] = cos(PI * j * (k + 0.5) / M) * (j ? 2.0 : 1.0) / M;
+        for (int i = 0; i < NUM_ORBIT_SERIES; i++)
+        {
+            double sum = 0;
+            for (int k = 0; k < M; k++)
+                sum += w[k] * v[i][k];
+            f->c[i][j] = sum;
+        }
+    }
+
+    f->iode = eph.Iode();
+    f->t0 = t0;
+}
+
+/**
+ * @brief empty the cache, e.g. when switching to another data set
+ */
+void OrbitCacheReset(ORBIT_CACHE *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+/**
+ * @brief satellite state at time t, interpolated; fits a new span on a miss
+ * @param eph ephemeris table, indexed by PRN
+ * @param t GPS time of week (s)
+ * @return false if 'sv' has no valid ephemeris
+ */
+bool OrbitCacheGet(ORBIT_CACHE *c, EPHEM eph[], int sv, double t, SV_STATE *s)
+{
+    if (sv < 0 || sv >= NUM_SATS || !eph[sv].Valid())
+        return false;
+
+    ORBIT_FIT *f = &c->fit[sv];
+    double dt = t - f->t0;
+    if (f->iode != eph[sv].Iode() || !(dt >= 0 && dt <= ORBIT_SPAN))
+    {
+        Fit(f, eph[sv], floor(t / ORBIT_SPAN) * ORBIT_SPAN);
+        dt = t - f->t0;
+        c->fits++;
+    }
+    else
+        c->hits++;
+
+    // T_j(x) and dT_j/dx once, then one dot product per output; unlike a
+    // Clenshaw recurrence per series these are independent of each other.
+    double x = dt * (2 / ORBIT_SPAN) - 1;
+    double T[ORBIT_DEGREE + 1], dT[ORBIT_DEGREE + 1];
+    T[0] = 1, T[1] = x;
+    dT[0] = 0, dT[1] = 1;
+    for (int j = 1; j < ORBIT_DEGREE; j++)
+    {
+        T[j + 1] = 2 * x * T[j] - T[j - 1];
+        dT[j + 1] = 2 * T[j] + 2 * x * dT[j] - dT[j - 1];
+    }
+
+    double p[NUM_ORBIT_SERIES] = {}, v[NUM_ORBIT_SERIES] = {};
+    for (int i = 0; i < NUM_ORBIT_SERIES; i++)
+        for (int j = 0; j <= ORBIT_DEGREE; j++)
+        {
+            p[i] += f->c[i][j] * T[j];
+            v[i] += f->c[i][j] * dT[j];
+        }
+
+    const double rate = 2 / ORBIT_SPAN; // d(x)/dt
+    s->x = p[ORBIT_X];
+    s->y = p[ORBIT_Y];
+    s->z = p[ORBIT_Z];
+    s->clk_bias = p[ORBIT_CLK];
+    s->rel = p[ORBIT_REL];
+    s->vx = v[ORBIT_X] * rate;
+    s->vy = v[ORBIT_Y] * rate;
+    s->vz = v[ORBIT_Z] * rate;
+    s->clk_drift = v[ORBIT_CLK] * rate;
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef _ORBITCACHE_H
+#define _ORBITCACHE_H 1
+
+#include "gps.h"
+#include "ephemeris.h"
+
+//////////////////////////////////////////////////////////////
+// Orbit interpolation cache
+//
+// For high-rate solutions and reprocessing: the first lookup of an SV in an
+// ORBIT_SPAN window samples EPHEM::Evaluate at Chebyshev nodes and fits
+// position, clock bias and relativistic term; later lookups in the window
+// cost a few dozen multiply-adds, velocity and clock drift coming from the
+// derivative of the same series. A fit is keyed by IODE and refitted as soon
+// as the ephemeris changes. The cache is owned by its caller, one per
+// thread, so it needs no locking.
+
+#define ORBIT_SPAN 300.0 // seconds covered by one fit
+#define ORBIT_DEGREE 7   // Chebyshev degree; a few um over ORBIT_SPAN
+
+enum ORBIT_SERIES
+{
+    ORBIT_X,
+    ORBIT_Y,
+    ORBIT_Z,
+    ORBIT_CLK,
+    ORBIT_REL,
+    NUM_ORBIT_SERIES
+};
+
+struct ORBIT_FIT
+{
+    unsigned iode; // 0: empty
+    double t0;     // start of the span (s of week)
+    double c[NUM_ORBIT_SERIES][ORBIT_DEGREE + 1];
+};
+
+struct ORBIT_CACHE
+{
+    ORBIT_FIT fit[NUM_SATS];
+    unsigned hits, fits;
+};
+
+void OrbitCacheReset(ORBIT_CACHE *c);
+bool OrbitCacheGet(ORBIT_CACHE *c, EPHEM eph[], int sv, double t, SV_STATE *s);
+
+#endif // _ORBITCACHE_H
@@ -0,0 +1,148 @@
+#include <atomic>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "gps.h"
+#include "perf.h"
+
+#define PERF_UNOPENED -2
+#define PERF_UNAVAILABLE -1
+
+static const uint64_t PerfEvents[] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+#define NUM_PERF_EVENTS (sizeof(PerfEvents) / sizeof(PerfEvents[0]))
+
+static __thread int PerfGroup = PERF_UNOPENED;
+
+struct PERF_KERNEL_SUM
+{
+    std::atomic<uint64_t> cycles, instructions, cache_misses, branch_misses, ops;
+};
+
+static PERF_KERNEL_SUM KernelSums[NUM_PERF_KERNELS];
+static const char *const KernelNames[NUM_PERF_KERNELS] = {"preamble", "parity", "bit_sample", "kepler"};
+
+static int PerfOpenEvent(uint64_t config, int group, bool kernel)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group < 0; // the leader starts the whole group
+    attr.exclude_kernel = !kernel;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Open this thread's counter group, with kernel counting if permitted.
+static int PerfOpen()
+{
+    for (int kernel = 1; kernel >= 0; kernel--)
+    {
+        int fds[NUM_PERF_EVENTS];
+        unsigned n;
+        for (n = 0; n < NUM_PERF_EVENTS; n++)
+        {
+            fds[n] = PerfOpenEvent(PerfEvents[n], n ? fds[0] : -1, kernel);
+            if (fds[n] < 0)
+                break;
+        }
+        if (n == NUM_PERF_EVENTS)
+        {
+            ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            return fds[0]; // the other members stay open with the group
+        }
+        while (n--)
+            close(fds[n]);
+    }
+    Warn("Hardware performance counters unavailable: {}", strerror(errno));
+    return PERF_UNAVAILABLE;
+}
+
+/**
+ * @brief read the calling thread's counters, opening them on first use
+ * @return false if counters are not available on this system
+ */
+bool PerfRead(PERF_COUNTS *c)
+{
+    if (PerfGroup == PERF_UNOPENED)
+        PerfGroup = PerfOpen();
+    if (PerfGroup < 0)
+        return false;
+
+    uint64_t buf[3 + NUM_PERF_EVENTS]; // nr, time enabled, time running, one value per event
+    if (read(PerfGroup, buf, sizeof(buf)) != sizeof(buf) || buf[0] != NUM_PERF_EVENTS)
+        return false;
+
+    // With more events than counters the kernel rotates groups on and off the
+    // PMU; extrapolate to the whole time the group was enabled. A group that
+    // has not been on the PMU yet has nothing to extrapolate from, so its
+    // counts are reported as unavailable rather than as zero.
+    uint64_t enabled = buf[1], running = buf[2];
+    if (!running)
+        return false;
+    uint64_t v[NUM_PERF_EVENTS];
+    for (unsigned i = 0; i < NUM_PERF_EVENTS; i++)
+        v[i] = running < enabled ? (uint64_t)((double)buf[3 + i] * enabled / running) : buf[3 + i];
+    c->cycles = v[0];
+    c->instructions = v[1];
+    c->cache_misses = v[2];
+    c->branch_misses = v[3];
+    return true;
+}
+
+/**
+ * @brief add the counts of one run of a decoding kernel, from any thread
+ * @param ops operations the run covered
+ */
+void PerfKernelAdd(PERF_KERNEL k, const PERF_COUNTS &t0, const PERF_COUNTS &t1, uint64_t ops)
+{
+    PERF_KERNEL_SUM &s = KernelSums[k];
+    s.cycles.fetch_add(t1.cycles - t0.cycles, std::memory_order_relaxed);
+    s.instructions.fetch_add(t1.instructions - t0.instructions, std::memory_order_relaxed);
+    s.cache_misses.fetch_add(t1.cache_misses - t0.cache_misses, std::memory_order_relaxed);
+    s.branch_misses.fetch_add(t1.branch_misses - t0.branch_misses, std::memory_order_relaxed);
+    s.ops.fetch_add(ops, std::memory_order_relaxed);
+}
+
+/**
+ * @brief log per-operation costs of every kernel measured so far
+ */
+void PerfKernelLog()
+{
+    for (int k = 0; k < NUM_PERF_KERNELS; k++)
+    {
+        PERF_KERNEL_SUM &s = KernelSums[k];
+        PERF_COUNTS c = {s.cycles.load(std::memory_order_relaxed), s.instructions.load(std::memory_order_relaxed),
+                         s.cache_misses.load(std::memory_order_relaxed),
+                         s.branch_misses.load(std::memory_order_relaxed)};
+        PerfLog(KernelNames[k], c, s.ops.load(std::memory_order_relaxed));
+    }
+}
+
+/**
+ * @brief log per-operation costs of a measured region
+ * @param what label
+ * @param c counts accumulated over the region
+ * @param ops number of operations (calls, words, ...) they cover
+ */
+void PerfLog(const char *what, const PERF_COUNTS &c, uint64_t ops)
+{
+    if (!ops)
+        return;
+    Info("Perf {:<16} n {:>8} cycles {:>9.1f} insns {:>9.1f} IPC {:>4.2f} cache miss {:>6.2f} branch miss {:>6.2f} /op",
+         what, ops, (double)c.cycles / ops, (double)c.instructions / ops,
+         c.cycles ? (double)c.instructions / c.cycles : 0.0, (double)c.cache_misses / ops,
+         (double)c.branch_misses / ops);
+}
@@ -0,0 +1,74 @@
+#ifndef _PERF_H
+#define _PERF_H 1
+
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////
+// Hardware performance counters
+//
+// A thin perf_event_open wrapper: one counter group (cycles, instructions,
+// cache misses, branch misses) per thread, opened on first use and read with
+// a single read() call. Kernel time, such as the /dev/mem mapping done by
+// MemRead, is counted when perf_event_paranoid allows it and left out
+// otherwise. Counts are scaled up for the time the group was multiplexed
+// off the PMU. Where there are no counters (no PMU, or perf is disabled)
+// reads fail and the callers carry on without them.
+
+struct PERF_COUNTS
+{
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+    uint64_t branch_misses;
+};
+
+bool PerfRead(PERF_COUNTS *c);
+void PerfLog(const char *what, const PERF_COUNTS &c, uint64_t ops);
+
+static inline void PerfAccumulate(PERF_COUNTS *sum, const PERF_COUNTS &t0, const PERF_COUNTS &t1)
+{
+    sum->cycles += t1.cycles - t0.cycles;
+    sum->instructions += t1.instructions - t0.instructions;
+    sum->cache_misses += t1.cache_misses - t0.cache_misses;
+    sum->branch_misses += t1.branch_misses - t0.branch_misses;
+}
+
+// Decoding kernels measured by PERF_SCOPE
+enum PERF_KERNEL
+{
+    PERF_PREAMBLE,
+    PERF_PARITY,
+    PERF_BIT_SAMPLE,
+    PERF_KEPLER,
+    NUM_PERF_KERNELS
+};
+
+void PerfKernelAdd(PERF_KERNEL k, const PERF_COUNTS &t0, const PERF_COUNTS &t1, uint64_t ops);
+void PerfKernelLog();
+
+// Adds the counts of the enclosing scope to kernel 'k', over 'ops'
+// operations, which may be changed until the scope ends. Only built with
+// -DLATENCY_PERF, and reported with the latency summary; otherwise it does
+// nothing. The scope must not yield: the counters belong to the worker
+// thread, not the task.
+struct PERF_SCOPE
+{
+    uint64_t ops;
+#ifdef LATENCY_PERF
+    PERF_KERNEL kernel;
+    PERF_COUNTS t0;
+    bool ok;
+
+    PERF_SCOPE(PERF_KERNEL k, uint64_t n = 1) : ops(n), kernel(k) { ok = PerfRead(&t0); }
+    ~PERF_SCOPE()
+    {
+        PERF_COUNTS t1;
+        if (ok && PerfRead(&t1))
+            PerfKernelAdd(kernel, t0, t1, ops);
+    }
+#else
+    PERF_SCOPE(PERF_KERNEL, uint64_t n = 1) : ops(n) {}
+#endif
+};
+
+#endif // _PERF_H
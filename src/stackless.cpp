@@ -0,0 +1,127 @@
+#ifdef GPS_STACKLESS
+
+#define LOG_MODULE LOG_MODULE_SCHED
+
+#include "gps.h"
+#include "stackless.h"
+
+thread_local ARENA *FrameArena;
+
+// Sleeping tasklets, soonest first, and tasklets waiting for events.
+// Tasklets all live on one hosting task.
+static SLEEP *Sleepers;
+static WAITEVENT *Waiters;
+
+void *ARENA::Alloc(size_t n)
+{
+    // Frames are prefixed with their arena so operator delete can find it.
+    // 'base' is max_align_t aligned and 'used' is kept a multiple of it.
+    const size_t hdr = alignof(max_align_t);
+    n = (n + hdr - 1) / hdr * hdr;
+    if (used + hdr + n > size)
+        return nullptr;
+    char *p = base + used;
+    used += hdr + n;
+    *(ARENA **)p = this;
+    return p + hdr;
+}
+
+void ARENA::Free(void *)
+{
+    // One frame per arena: releasing it empties the arena.
+    used = 0;
+}
+
+void *TASKLET::promise_type::operator new(size_t n) noexcept
+{
+    if (!FrameArena)
+        return nullptr;
+    void *p = FrameArena->Alloc(n);
+    if (!p)
+        Error("Tasklet frame of {} bytes does not fit arena of {}", n, FrameArena->size);
+    return p;
+}
+
+void TASKLET::promise_type::operator delete(void *p) noexcept
+{
+    char *frame = (char *)p - alignof(max_align_t);
+    (*(ARENA **)frame)->Free(frame);
+}
+
+SLEEP::SLEEP(unsigned ms) : wake(Nanoseconds() + (uint64_t)ms * 1000000), next(nullptr)
+{
+}
+
+void SLEEP::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    handle = h;
+    SLEEP **link = &Sleepers;
+    while (*link && (*link)->wake <= wake)
+        link = &(*link)->next;
+    next = *link;
+    *link = this;
+}
+
+bool WAITEVENT::await_ready() noexcept
+{
+    caught = EventCatch(mask);
+    return caught != 0;
+}
+
+void WAITEVENT::await_suspend(std::coroutine_handle<> h) noexcept
+{
+    handle = h;
+    next = Waiters;
+    Waiters = this;
+}
+
+/**
+ * @brief resume every tasklet that is due or whose event was raised; if none
+ * is, park the calling (hosting) task until one is
+ * @param wake further events that should end the wait; they are consumed
+ */
+void StacklessRun(unsigned wake)
+{
+    unsigned mask = wake;
+    for (WAITEVENT *w = Waiters; w; w = w->next)
+        mask |= w->mask;
+
+    uint64_t now = Nanoseconds();
+    unsigned sigs = EventCatch(mask);
+    if (!sigs && (!Sleepers || Sleepers->wake > now))
+    {
+        if (mask && !Sleepers)
+            sigs = EventWait(mask);
+        else
+        {
+            uint64_t ns = Sleepers ? Sleepers->wake - now : 1000000;
+            TimerWait((ns + 999999) / 1000000);
+            sigs = EventCatch(mask);
+        }
+        now = Nanoseconds();
+    }
+
+    WAITEVENT *list = Waiters;
+    Waiters = nullptr;
+    while (WAITEVENT *w = list)
+    {
+        list = w->next;
+        w->caught = sigs & w->mask;
+        if (w->caught)
+            w->handle.resume(); // may add itself back to 'Waiters'
+        else
+        {
+            w->next = Waiters;
+            Waiters = w;
+        }
+    }
+
+    while (Sleepers && Sleepers->wake <= now)
+    {
+        SLEEP *s = Sleepers;
+        Sleepers = s->next;
+        s->handle.resume();
+    }
+}
+
+#endif // GPS_STACKLESS
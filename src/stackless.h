@@ -0,0 +1,126 @@
+#ifndef _STACKLESS_H
+#define _STACKLESS_H 1
+
+#ifdef GPS_STACKLESS
+
+#include <coroutine>
+#include <exception>
+#include <stddef.h>
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////
+// Stackless tasks (C++20)
+//
+// A TASKLET is a C++20 coroutine whose frame comes from a small per-task
+// ARENA instead of the heap or a 32 KB stack. Tasklets only suspend in
+// SLEEP- or WAITEVENT-based awaiters; StacklessRun() resumes the ones that
+// are due and otherwise parks the hosting stackful task in TimerWait or
+// EventWait.
+
+struct ARENA
+{
+    char *base;
+    size_t size;
+    size_t used;
+
+    void Init(void *mem, size_t bytes)
+    {
+        base = (char *)mem;
+        size = bytes;
+        used = 0;
+    }
+    void *Alloc(size_t n);
+    void Free(void *p);
+};
+
+struct TASKLET
+{
+    struct promise_type
+    {
+        static void *operator new(size_t n) noexcept;
+        static void operator delete(void *p) noexcept;
+        static TASKLET get_return_object_on_allocation_failure() { return TASKLET(); }
+
+        TASKLET get_return_object() { return TASKLET(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    TASKLET() : handle(nullptr) {}
+    explicit TASKLET(std::coroutine_handle<promise_type> h) : handle(h) {}
+    TASKLET(TASKLET &&t) : handle(t.handle) { t.handle = nullptr; }
+    TASKLET &operator=(TASKLET &&t)
+    {
+        if (handle)
+            handle.destroy();
+        handle = t.handle;
+        t.handle = nullptr;
+        return *this;
+    }
+    ~TASKLET()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    explicit operator bool() const { return (bool)handle; }
+    bool Done() const { return handle && handle.done(); }
+};
+
+// Arena the next tasklet frame is allocated from, see TaskletSpawn().
+extern thread_local ARENA *FrameArena;
+
+/**
+ * @brief start a tasklet with its frame in 'arena'; it runs up to its first
+ * suspension point before this returns
+ * @return the tasklet, empty if its frame did not fit in 'arena'
+ */
+template <typename F>
+TASKLET TaskletSpawn(ARENA &arena, F start)
+{
+    FrameArena = &arena;
+    TASKLET t = start();
+    FrameArena = nullptr;
+    return t;
+}
+
+struct SLEEP
+{
+    uint64_t wake; // monotonic ns
+    std::coroutine_handle<> handle;
+    SLEEP *next;
+
+    explicit SLEEP(unsigned ms);
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept;
+    void await_resume() const noexcept {}
+};
+
+inline SLEEP Sleep(unsigned ms)
+{
+    return SLEEP(ms);
+}
+
+// Resumes once any event in 'mask' is raised, see EventRaise().
+struct WAITEVENT
+{
+    unsigned mask;
+    unsigned caught;
+    std::coroutine_handle<> handle;
+    WAITEVENT *next;
+
+    explicit WAITEVENT(unsigned m) : mask(m), caught(0), next(nullptr) {}
+    bool await_ready() noexcept;
+    void await_suspend(std::coroutine_handle<> h) noexcept;
+    unsigned await_resume() const noexcept { return caught; }
+};
+
+void StacklessRun(unsigned wake = 0);
+
+#endif // GPS_STACKLESS
+
+#endif // _STACKLESS_H
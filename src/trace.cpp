@@ -0,0 +1,102 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gps.h"
+#include "trace.h"
+
+static TRACE_HEADER *Ring;
+static TRACE_REC *Recs;
+static uint64_t Mask;
+static size_t MapBytes;
+
+/**
+ * @brief map the trace ring file, continuing an existing ring of the same shape
+ * @param path trace file
+ * @param records ring capacity, rounded down to a power of two
+ * @return true if tracing is on
+ */
+bool TraceOpen(const char *path, uint64_t records)
+{
+    if (Ring || records < 2)
+        return false;
+    while (records & (records - 1))
+        records &= records - 1;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+
+    TRACE_HEADER old;
+    bool resume = pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+                  old.magic == TRACE_MAGIC && old.version == TRACE_VERSION &&
+                  old.rec_size == sizeof(TRACE_REC) && old.records == records;
+
+    size_t bytes = sizeof(TRACE_HEADER) + records * sizeof(TRACE_REC);
+    if ((!resume && ftruncate(fd, 0) < 0) || ftruncate(fd, bytes) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    TRACE_HEADER *h = (TRACE_HEADER *)map;
+    if (!resume)
+    {
+        h->version = TRACE_VERSION;
+        h->rec_size = sizeof(TRACE_REC);
+        h->records = records;
+        h->head = 0;
+        __atomic_store_n(&h->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    Recs = (TRACE_REC *)(h + 1);
+    Mask = records - 1;
+    MapBytes = bytes;
+    __atomic_store_n(&Ring, h, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief stop tracing and flush the ring to the file
+ *
+ * The mapping is left in place: a TraceEvent() on another worker may have
+ * loaded 'Ring' just before it was cleared and still be writing its record.
+ * It goes away with the process.
+ */
+void TraceClose()
+{
+    TRACE_HEADER *h = __atomic_exchange_n(&Ring, (TRACE_HEADER *)NULL, __ATOMIC_ACQ_REL);
+    if (!h)
+        return;
+    msync(h, MapBytes, MS_SYNC);
+}
+
+/**
+ * @brief append one record to the trace ring; a no-op unless TraceOpen() succeeded
+ * @param ch channel
+ * @param event record type, see TRACE_EVENT for the meaning of the args
+ */
+void TraceEvent(unsigned ch, TRACE_EVENT event, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+    TRACE_HEADER *h = __atomic_load_n(&Ring, __ATOMIC_ACQUIRE);
+    if (!h)
+        return;
+
+    uint64_t n = __atomic_fetch_add(&h->head, 1, __ATOMIC_RELAXED);
+    TRACE_REC *r = Recs + (n & Mask);
+    r->ns = Nanoseconds();
+    r->ch = ch;
+    r->event = event;
+    r->arg[0] = a0;
+    r->arg[1] = a1;
+    r->arg[2] = a2;
+    r->arg[3] = a3;
+    // A record whose seq does not match its position was torn by a crash
+    // or is left over from the previous lap; the decoder skips it.
+    __atomic_store_n(&r->seq, (uint32_t)n, __ATOMIC_RELEASE);
+}
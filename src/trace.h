@@ -0,0 +1,68 @@
+#ifndef _TRACE_H
+#define _TRACE_H 1
+
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////
+// Binary channel trace
+//
+// Fixed-size records go into a ring in a memory-mapped file. A record costs
+// one atomic add and a 32-byte store; the page cache writes it back in large
+// blocks, so the SD card sees far less I/O than the equivalent text lines.
+// tools/tracedump converts a trace file to text or CSV.
+
+#define TRACE_MAGIC 0x4543415254535047ULL // "GPSTRACE"
+#define TRACE_VERSION 1
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS (1 << 20) // 32 MB, hours of full-rate history
+#endif
+#ifndef TRACE_FILE
+#define TRACE_FILE "logs/trace.bin"
+#endif
+
+enum TRACE_EVENT
+{
+    TRACE_FETCH,      // rx_state, accepted, buf_tail
+    TRACE_BIT_SYNC,   // edge_total, max_edge_num, sec_edge_num, bit offset or -1
+    TRACE_BIT_SAMPLE, // bits sampled, nav_tail
+    TRACE_FRAME_SYNC, // nbits shifted, nav_tail
+    TRACE_SUBFRAME,   // sv, subframe id, TOW
+    TRACE_LOST,       // sv (watchdog expired)
+    NUM_TRACE_EVENTS
+};
+
+struct TRACE_HEADER
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t records; // ring capacity
+    uint64_t head;    // records ever written; slot is head % records
+    uint8_t pad[32];
+};
+
+struct TRACE_REC
+{
+    uint64_t ns;  // Nanoseconds()
+    uint32_t seq; // low bits of the record number, written last
+    uint16_t ch;
+    uint16_t event;
+    uint32_t arg[4];
+};
+
+static_assert(sizeof(TRACE_HEADER) == 64, "trace header layout");
+static_assert(sizeof(TRACE_REC) == 32, "trace record layout");
+
+static inline const char *TraceEventName(unsigned event)
+{
+    static const char *const names[NUM_TRACE_EVENTS] = {
+        "fetch", "bit_sync", "bit_sample", "frame_sync", "subframe", "lost"};
+    return event < NUM_TRACE_EVENTS ? names[event] : "?";
+}
+
+bool TraceOpen(const char *path = TRACE_FILE, uint64_t records = TRACE_RECORDS);
+void TraceClose();
+void TraceEvent(unsigned ch, TRACE_EVENT event,
+                uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0);
+
+#endif // _TRACE_H
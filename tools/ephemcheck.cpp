@@ -0,0 +1,185 @@
+// Check EphemBatchEval (src/ephembatch.h) and OrbitCacheGet
+// (src/orbitcache.h) against EPHEM::Evaluate.
+//
+//   ephemcheck [seed]
+//
+// Builds one ephemeris per PRN from randomised but realistic subframes 1-3,
+// evaluates the batch kernel and the scalar model over +-4 hours around t_oe
+// and fails if positions differ by more than POS_TOL or clock corrections by
+// more than CLK_TOL. Then samples every ORBIT_SPAN fit of the orbit cache in
+// the same period and fails if the interpolation error exceeds the FIT_*
+// bounds. Run by ctest, so a change to the kernel, to the fit or to how the
+// compiler vectorises them (AVX2, NEON, target_clones) cannot go unnoticed.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/ephembatch.h"
+#include "../src/orbitcache.h"
+
+#define POS_TOL 1e-3  // m
+#define CLK_TOL 1e-12 // s, 0.3 mm
+
+#define FIT_POS_TOL 1.1e-6 // m, as measured for ORBIT_DEGREE 7
+#define FIT_VEL_TOL 2e-7   // m/s
+#define FIT_CLK_TOL 1e-15  // s
+#define FIT_SAMPLES 16     // points per span, both ends included
+
+// Store the low 'len' bits of 'raw' at IS-GPS-200 word/bit position.
+static void Put(uint32_t *nav, int word, int bit, int len, int64_t raw)
+{
+    int o = 24 * (word - 1) + bit - 1;
+    for (int i = 0; i < len; i++)
+    {
+        int b = o + i;
+        nav[b / 24] |= (uint32_t)(raw >> (len - 1 - i) & 1) << (23 - b % 24);
+    }
+}
+
+static int64_t Raw(double v, int pow2)
+{
+    return llround(ldexp(v, -pow2));
+}
+
+static double Uniform(double lo, double hi)
+{
+    return lo + (hi - lo) * drand48();
+}
+
+static void Load(EPHEM *eph, unsigned iod, double t_oe, double e)
+{
+    uint32_t nav[3][NAV_WORDS];
+    memset(nav, 0, sizeof(nav));
+    for (int id = 1; id <= 3; id++)
+    {
+        Put(nav[id - 1], 2, 1, 17, (int64_t)(t_oe / 6) & 0x1ffff); // TOW
+        Put(nav[id - 1], 2, 20, 3, id);
+    }
+
+    uint32_t *sf = nav[0];
+    Put(sf, 3, 1, 10, 2200 % 1024);                          // week
+    Put(sf, 7, 17, 8, Raw(Uniform(-1e-8, 1e-8), -31));       // t_gd
+    Put(sf, 8, 1, 8, iod);                                   // IODC
+    Put(sf, 8, 9, 16, Raw(t_oe, 4));                         // t_oc
+    Put(sf, 9, 1, 8, 0);                                     // a_f2
+    Put(sf, 9, 9, 16, Raw(Uniform(-1e-11, 1e-11), -43));     // a_f1
+    Put(sf, 10, 1, 22, Raw(Uniform(-5e-4, 5e-4), -31));      // a_f0
+
+    sf = nav[1];
+    Put(sf, 3, 1, 8, iod);                                   // IODE
+    Put(sf, 3, 9, 16, Raw(Uniform(-150, 150), -5));          // C_rs
+    Put(sf, 4, 1, 16, Raw(Uniform(1e-9, 1.6e-9), -43));      // dn
+    Put(sf, 4, 17, 32, Raw(Uniform(-1, 1), -31));            // M_0
+    Put(sf, 6, 1, 16, Raw(Uniform(-8e-6, 8e-6), -29));       // C_uc
+    Put(sf, 6, 17, 32, Raw(e, -33));                         // e
+    Put(sf, 8, 1, 16, Raw(Uniform(-1e-5, 1e-5), -29));       // C_us
+    Put(sf, 8, 17, 32, Raw(Uniform(5153.5, 5153.8), -19));   // sqrt(A)
+    Put(sf, 10, 1, 16, Raw(t_oe, 4));                        // t_oe
+
+    sf = nav[2];
+    Put(sf, 3, 1, 16, Raw(Uniform(-2e-7, 2e-7), -29));       // C_ic
+    Put(sf, 3, 17, 32, Raw(Uniform(-1, 1), -31));            // OMEGA_0
+    Put(sf, 5, 1, 16, Raw(Uniform(-2e-7, 2e-7), -29));       // C_is
+    Put(sf, 5, 17, 32, Raw(Uniform(0.29, 0.32), -31));       // i_0
+    Put(sf, 7, 1, 16, Raw(Uniform(150, 350), -5));           // C_rc
+    Put(sf, 7, 17, 32, Raw(Uniform(-1, 1), -31));            // omega
+    Put(sf, 9, 1, 24, Raw(Uniform(-2.8e-9, -2.4e-9), -43));  // OMEGA_dot
+    Put(sf, 10, 1, 8, iod);                                  // IODE
+    Put(sf, 10, 9, 14, Raw(Uniform(-1e-10, 1e-10), -43));    // IDOT
+
+    for (int id = 0; id < 3; id++)
+        eph->Subframe(nav[id]);
+}
+
+int main(int argc, char *argv[])
+{
+    srand48(argc > 1 ? atol(argv[1]) : 1);
+
+    static EPHEM eph[NUM_SATS];
+    double t_oe[NUM_SATS];
+    for (int sv = 1; sv < NUM_SATS; sv++)
+    {
+        // PRN 1 sits at the end of the week to cover the rollover; PRN 2
+        // exceeds EPH_E_MAX and takes the scalar fallback.
+        t_oe[sv] = sv == 1 ? 0 : 7200 * (sv % 84);
+        Load(&eph[sv], sv, t_oe[sv], sv == 2 ? 0.12 : Uniform(0.001, 0.025));
+    }
+
+    static EPH_BATCH batch;
+    if (EphemBatchLoad(&batch, eph, NUM_SATS) != NUM_SATS - 1)
+    {
+        fprintf(stderr, "ephemcheck: only %d of %d ephemerides valid\n", batch.num, NUM_SATS - 1);
+        return 1;
+    }
+
+    double pos_max = 0, clk_max = 0;
+    int worst = 0, evals = 0;
+    for (int k = -48; k <= 48; k++)
+    {
+        for (int sv = 1; sv < NUM_SATS; sv++)
+        {
+            double t = fmod(t_oe[sv] + 300.0 * k + 604800, 604800);
+            SV_BATCH out;
+            EphemBatchEval(&batch, t, &out);
+            for (int i = 0; i < out.num; i++)
+            {
+                if (out.sv[i] != sv)
+                    continue;
+                SV_STATE s = eph[sv].Evaluate(t);
+                double d = sqrt((out.x[i] - s.x) * (out.x[i] - s.x) + (out.y[i] - s.y) * (out.y[i] - s.y) +
+                                (out.z[i] - s.z) * (out.z[i] - s.z));
+                double c = fabs(out.clk_bias[i] - s.clk_bias);
+                if (d > pos_max || isnan(d)) // a NaN sticks
+                    pos_max = d, worst = sv;
+                if (c > clk_max || isnan(c))
+                    clk_max = c;
+                evals++;
+            }
+        }
+    }
+
+    bool ok = evals == 97 * (NUM_SATS - 1) && pos_max <= POS_TOL && clk_max <= CLK_TOL;
+    printf("ephemcheck: %d evaluations, position error max %.3g m (PRN %d), clock error max %.3g s: %s\n", evals,
+           pos_max, worst, clk_max, ok ? "ok" : "FAILED");
+
+    // Orbit cache: every span in the same +-4 hours, sampled end to end.
+    static ORBIT_CACHE cache;
+    OrbitCacheReset(&cache);
+    double vel_max = 0;
+    pos_max = clk_max = 0;
+    worst = evals = 0;
+    for (int sv = 1; sv < NUM_SATS; sv++)
+    {
+        for (int k = -48; k < 48; k++)
+        {
+            double t0 = fmod(t_oe[sv] + ORBIT_SPAN * k + 604800, 604800);
+            for (int j = 0; j <= FIT_SAMPLES; j++)
+            {
+                double t = t0 + ORBIT_SPAN * j / FIT_SAMPLES;
+                SV_STATE c, s = eph[sv].Evaluate(t);
+                if (!OrbitCacheGet(&cache, eph, sv, t, &c))
+                    continue;
+                double d = sqrt((c.x - s.x) * (c.x - s.x) + (c.y - s.y) * (c.y - s.y) + (c.z - s.z) * (c.z - s.z));
+                double v = sqrt((c.vx - s.vx) * (c.vx - s.vx) + (c.vy - s.vy) * (c.vy - s.vy) +
+                                (c.vz - s.vz) * (c.vz - s.vz));
+                double b = fabs(c.clk_bias - s.clk_bias);
+                if (d > pos_max || isnan(d))
+                    pos_max = d, worst = sv;
+                if (v > vel_max || isnan(v))
+                    vel_max = v;
+                if (b > clk_max || isnan(b))
+                    clk_max = b;
+                evals++;
+            }
+        }
+    }
+
+    bool fit_ok = evals == 96 * (FIT_SAMPLES + 1) * (NUM_SATS - 1) && pos_max <= FIT_POS_TOL &&
+                  vel_max <= FIT_VEL_TOL && clk_max <= FIT_CLK_TOL;
+    printf("ephemcheck: %d cached lookups in %u fits, position error max %.3g m (PRN %d), velocity %.3g m/s, "
+           "clock %.3g s: %s\n",
+           evals, cache.fits, pos_max, worst, vel_max, clk_max, fit_ok ? "ok" : "FAILED");
+    return ok && fit_ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+// Measure the scheduler cost of many sleeping tasks (see TimerWait in
+// src/coroutines.cpp).
+//
+//   sleepbench [-p] [-n tasks] [-s seconds]
+//
+// Starts 'tasks' sleepers (default 1000), each waking on its own period of
+// 20..1000 ms, runs them on one worker for 'seconds' (default 10) and reports
+// the CPU time the process used and how late the wakeups were. -p sleeps the
+// way TimerWait did before the timer wheel, by yielding and re-reading the
+// clock every scheduler round, for comparison.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "../src/gps.h"
+
+static bool Poll;
+static volatile bool Stop;
+static std::atomic<unsigned> Started(0);
+static std::atomic<uint64_t> Wakeups(0), LateSum(0), LateMax(0);
+
+// TimerWait as it was before the wheel
+static void PollWait(unsigned ms)
+{
+    uint64_t finish = Nanoseconds() + (uint64_t)ms * 1000000;
+    for (;;)
+    {
+        NextTask();
+        if (Nanoseconds() >= finish)
+            break;
+    }
+}
+
+static void Sleeper()
+{
+    unsigned period = 20 + Started++ * 613 % 981; // ms, spread over 20..1000
+    while (!Stop)
+    {
+        uint64_t due = Nanoseconds() + (uint64_t)period * 1000000;
+        if (Poll)
+            PollWait(period);
+        else
+            TimerWait(period);
+        uint64_t late = Nanoseconds() - due;
+        Wakeups++;
+        LateSum += late;
+        uint64_t max = LateMax.load();
+        while (late > max && !LateMax.compare_exchange_weak(max, late))
+            ;
+    }
+    TaskExit();
+}
+
+static double CpuSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void Usage()
+{
+    fprintf(stderr, "usage: sleepbench [-p] [-n tasks] [-s seconds]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int tasks = 1000;
+    unsigned seconds = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "pn:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            Poll = true;
+            break;
+        case 'n':
+            tasks = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            Usage();
+        }
+    }
+    if (tasks <= 0 || !seconds)
+        Usage();
+
+    for (int i = 0; i < tasks; i++)
+    {
+        if (CreateTask(Sleeper, 16 * 1024) < 0)
+        {
+            fprintf(stderr, "sleepbench: could not create task %d\n", i);
+            return 1;
+        }
+    }
+
+    double cpu = CpuSeconds();
+    uint64_t start = Nanoseconds();
+    if (Poll)
+        PollWait(seconds * 1000);
+    else
+        TimerWait(seconds * 1000);
+    double wall = (Nanoseconds() - start) * 1e-9;
+    cpu = CpuSeconds() - cpu;
+    Stop = true;
+
+    uint64_t n = Wakeups.load();
+    printf("sleepbench: %s, %d tasks, %.1f s: %" PRIu64 " wakeups, cpu %.1f%%, %.2f us/wakeup, "
+           "late mean %.3f ms max %.3f ms\n",
+           Poll ? "poll" : "wheel", tasks, wall, n, 100 * cpu / wall, n ? cpu * 1e6 / n : 0.0,
+           n ? LateSum.load() * 1e-6 / n : 0.0, LateMax.load() * 1e-6);
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Decode a binary channel trace (see src/trace.h) to text or CSV.
+//
+//   tracedump [-c] [-n count] [file]
+//
+// -c writes CSV, -n limits output to the newest 'count' records.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/trace.h"
+
+static void Usage()
+{
+    fprintf(stderr, "usage: tracedump [-c] [-n count] [file]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    bool csv = false;
+    uint64_t limit = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "cn:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            csv = true;
+            break;
+        case 'n':
+            limit = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            Usage();
+        }
+    }
+    if (argc - optind > 1)
+        Usage();
+    const char *path = optind < argc ? argv[optind] : TRACE_FILE;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        perror(path);
+        return 1;
+    }
+
+    TRACE_HEADER h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != TRACE_MAGIC)
+    {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return 1;
+    }
+    if (h.version != TRACE_VERSION || h.rec_size != sizeof(TRACE_REC) ||
+        !h.records || (h.records & (h.records - 1)))
+    {
+        fprintf(stderr, "%s: unsupported trace version %u, record size %u\n", path, h.version, h.rec_size);
+        return 1;
+    }
+
+    TRACE_REC *recs = (TRACE_REC *)malloc(h.records * sizeof(TRACE_REC));
+    if (!recs || fread(recs, sizeof(TRACE_REC), h.records, fp) != h.records)
+    {
+        fprintf(stderr, "%s: truncated\n", path);
+        return 1;
+    }
+    fclose(fp);
+
+    uint64_t first = h.head > h.records ? h.head - h.records : 0;
+    if (limit && h.head - first > limit)
+        first = h.head - limit;
+
+    if (csv)
+        printf("seq,ns,ch,event,a0,a1,a2,a3\n");
+
+    uint64_t t0 = 0, last = 0, skipped = 0;
+    for (uint64_t n = first; n < h.head; n++)
+    {
+        const TRACE_REC &r = recs[n & (h.records - 1)];
+        if (r.seq != (uint32_t)n)
+        {
+            skipped++;
+            continue;
+        }
+        if (csv)
+        {
+            printf("%" PRIu64 ",%" PRIu64 ",%u,%s,%u,%u,%u,%u\n", n, r.ns, r.ch, TraceEventName(r.event),
+                   r.arg[0], r.arg[1], r.arg[2], r.arg[3]);
+            continue;
+        }
+        if (!t0)
+            t0 = r.ns;
+        else if (r.ns < last)
+        { // the ring was resumed after a reboot, the clock started again
+            printf("------------ clock restarted, times relative to here ------------\n");
+            t0 = r.ns;
+        }
+        last = r.ns;
+        printf("%12.6f ch%-2u %-10s", (int64_t)(r.ns - t0) * 1e-9, r.ch, TraceEventName(r.event));
+        switch (r.event)
+        {
+        case TRACE_FETCH:
+            printf(" rx_state %u %s buf_tail %u\n", r.arg[0], r.arg[1] ? "accepted" : "stale", r.arg[2]);
+            break;
+        case TRACE_BIT_SYNC:
+            printf(" edges %u max %u sec %u", r.arg[0], r.arg[1], r.arg[2]);
+            if ((int32_t)r.arg[3] >= 0)
+                printf(" synced at %ums\n", r.arg[3]);
+            else
+                printf(" no sync\n");
+            break;
+        case TRACE_BIT_SAMPLE:
+            printf(" %u bits nav_tail %u\n", r.arg[0], r.arg[1]);
+            break;
+        case TRACE_FRAME_SYNC:
+            printf(" shift %u nav_tail %u\n", r.arg[0], r.arg[1]);
+            break;
+        case TRACE_SUBFRAME:
+            printf(" PRN %u subframe %u TOW %u\n", r.arg[0], r.arg[1], r.arg[2]);
+            break;
+        case TRACE_LOST:
+            printf(" PRN %u\n", r.arg[0]);
+            break;
+        default:
+            printf(" %u %u %u %u\n", r.arg[0], r.arg[1], r.arg[2], r.arg[3]);
+            break;
+        }
+    }
+
+    fprintf(stderr, "%" PRIu64 " records, %" PRIu64 " torn or overwritten\n", h.head - first - skipped, skipped);
+    free(recs);
+    return 0;
+}